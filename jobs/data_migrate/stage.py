@@ -0,0 +1,452 @@
+#!/usr/bin/env python3
+
+# Copyright (C) SchedMD LLC.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Stage files between GCS and the cluster for data migration jobs
+
+Copies a file, object, directory or object prefix to DEST, like gsutil cp -r.
+Inside a job allocation the files are spread over the allocated nodes with
+srun, and each node copies its share with a pool of threads. Large files are
+transferred in slices: downloads write the slices in place and uploads compose
+them from temporary part objects.
+
+Files whose size and CRC32C already match at the destination are skipped, so
+a rerun only copies what changed. Interrupted sliced transfers resume from the
+slices already done.
+"""
+
+import argparse
+import base64
+import json
+import logging
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import threading
+from concurrent.futures import ThreadPoolExecutor
+from pathlib import Path
+from time import monotonic
+
+import google_crc32c
+from google.cloud import storage
+
+log = logging.getLogger(Path(__file__).name)
+
+MiB = 1024 * 1024
+# parts composed into an object per compose request
+COMPOSE_MAX = 32
+# suffix of the partial local file of a download, and of its state next to it
+STAGING_SUFFIX = ".staging"
+STAGING_FILES = (STAGING_SUFFIX, STAGING_SUFFIX + ".json")
+PART_INFIX = ".stage-part-"
+
+
+def is_gcs(uri):
+    return uri.startswith("gs://")
+
+
+def split_gcs(uri):
+    bucket, _, name = uri[len("gs://") :].partition("/")
+    return bucket, name
+
+
+def encode_crc32c(checksum):
+    """CRC32C in the base64 format of GCS object metadata"""
+    return base64.b64encode(checksum.digest()).decode()
+
+
+def file_crc32c(path, start=0, size=None, chunk=8 * MiB):
+    checksum = google_crc32c.Checksum()
+    with open(path, "rb") as f:
+        f.seek(start)
+        remaining = os.path.getsize(path) - start if size is None else size
+        while remaining > 0:
+            data = f.read(min(chunk, remaining))
+            if not data:
+                break
+            checksum.update(data)
+            remaining -= len(data)
+    return encode_crc32c(checksum)
+
+
+class Stager:
+    """copies the files of a plan, of one task of the job"""
+
+    def __init__(self, plan, threads):
+        self.plan = plan
+        self.client = storage.Client()
+        self.exe = ThreadPoolExecutor(max_workers=threads)
+        # slices of large files, files wait on these and not the other way
+        self.slice_exe = ThreadPoolExecutor(max_workers=threads)
+        self.lock = threading.Lock()
+        self.copied = 0
+        self.skipped = 0
+        self.failed = 0
+        self.bytes = 0
+
+    def bucket(self, name):
+        return self.client.bucket(name)
+
+    def blob(self, uri, generation=None):
+        bucket, name = split_gcs(uri)
+        return self.bucket(bucket).blob(name, generation=generation)
+
+    def get_blob(self, uri):
+        bucket, name = split_gcs(uri)
+        return self.bucket(bucket).get_blob(name)
+
+    def slices(self, size):
+        step = self.plan["slice_size"]
+        return [(start, min(step, size - start)) for start in range(0, size, step)]
+
+    def sliced(self, size):
+        return size >= self.plan["sliced_threshold"]
+
+    def unchanged(self, item):
+        """whether dest already has the content of src"""
+        src, dest, size = item["src"], item["dest"], item["size"]
+        if is_gcs(dest):
+            blob = self.get_blob(dest)
+            if blob is None or blob.size != size:
+                return False
+            dest_crc = blob.crc32c
+        else:
+            if not Path(dest).is_file() or os.path.getsize(dest) != size:
+                return False
+            dest_crc = file_crc32c(dest)
+        src_crc = item.get("crc32c") or file_crc32c(src)
+        item["crc32c"] = src_crc
+        return src_crc == dest_crc
+
+    def run(self, items):
+        """copy items, returns the number that failed"""
+        start = monotonic()
+        futures = [self.exe.submit(self.stage, item) for item in items]
+        for future in futures:
+            future.result()
+        self.exe.shutdown()
+        self.slice_exe.shutdown()
+        elapsed = monotonic() - start
+        rate = self.bytes / MiB / elapsed if elapsed else 0
+        print(
+            f"{socket.gethostname()}: copied {self.copied} files, "
+            f"skipped {self.skipped} unchanged, {self.failed} failed, "
+            f"{self.bytes / MiB:.1f} MiB in {elapsed:.1f}s ({rate:.1f} MiB/s)",
+            flush=True,
+        )
+        return self.failed
+
+    def stage(self, item):
+        try:
+            if self.unchanged(item):
+                log.debug(f"unchanged: {item['dest']}")
+                with self.lock:
+                    self.skipped += 1
+                return
+            if is_gcs(item["src"]) and is_gcs(item["dest"]):
+                self.rewrite(item)
+            elif is_gcs(item["src"]):
+                self.download(item)
+            elif is_gcs(item["dest"]):
+                self.upload(item)
+            else:
+                self.copy(item)
+        except Exception as e:
+            log.error(f"failed to copy {item['src']} to {item['dest']}: {e}")
+            with self.lock:
+                self.failed += 1
+            return
+        log.info(f"copied {item['src']} to {item['dest']}")
+        with self.lock:
+            self.copied += 1
+            self.bytes += item["size"]
+
+    def in_slices(self, func, slices):
+        """run func(start, size) for all slices on the slice thread pool"""
+        for future in [self.slice_exe.submit(func, *s) for s in slices]:
+            future.result()
+
+    def rewrite(self, item):
+        # server side copy, in as many calls as GCS needs
+        src = self.blob(item["src"])
+        dest = self.blob(item["dest"])
+        token, _, _ = dest.rewrite(src)
+        while token is not None:
+            token, _, _ = dest.rewrite(src, token=token)
+
+    def copy(self, item):
+        dest = Path(item["dest"])
+        dest.parent.mkdir(parents=True, exist_ok=True)
+        shutil.copyfile(item["src"], dest)
+
+    def download(self, item):
+        dest = Path(item["dest"])
+        dest.parent.mkdir(parents=True, exist_ok=True)
+        staging = dest.with_name(dest.name + STAGING_SUFFIX)
+        src = self.blob(item["src"], generation=item["generation"])
+        if not self.sliced(item["size"]):
+            src.download_to_filename(staging, checksum="crc32c")
+            os.replace(staging, dest)
+            return
+
+        # slices already in the staging file of an interrupted download of
+        # the same generation are kept
+        state_file = staging.with_name(staging.name + ".json")
+        try:
+            state = json.loads(state_file.read_text())
+        except (FileNotFoundError, ValueError):
+            state = {}
+        if state.get("generation") != item["generation"] or not staging.exists():
+            state = {"generation": item["generation"], "done": []}
+            with open(staging, "wb") as f:
+                f.truncate(item["size"])
+        done = set(state["done"])
+
+        def get_slice(start, size):
+            with open(staging, "r+b") as f:
+                f.seek(start)
+                src.download_to_file(f, start=start, end=start + size - 1)
+            with self.lock:
+                state["done"].append(start)
+                state_file.write_text(json.dumps(state))
+
+        todo = [s for s in self.slices(item["size"]) if s[0] not in done]
+        if len(todo) < len(self.slices(item["size"])):
+            log.info(f"resuming {dest} with {len(todo)} slices left")
+        self.in_slices(get_slice, todo)
+        staged_crc = file_crc32c(staging)
+        if staged_crc != item["crc32c"]:
+            state_file.unlink()
+            raise Exception(f"CRC32C mismatch {staged_crc} != {item['crc32c']}")
+        os.replace(staging, dest)
+        state_file.unlink()
+
+    def upload(self, item):
+        dest = self.blob(item["dest"])
+        if not self.sliced(item["size"]):
+            dest.upload_from_filename(item["src"], checksum="crc32c")
+            return
+
+        # parts that are already uploaded with the same content are kept
+        bucket = dest.bucket
+        slices = self.slices(item["size"])
+        parts = [
+            bucket.blob(f"{dest.name}{PART_INFIX}{i:05d}") for i in range(len(slices))
+        ]
+        existing = {
+            blob.name: blob.crc32c
+            for blob in self.client.list_blobs(bucket, prefix=dest.name + PART_INFIX)
+        }
+
+        def put_slice(start, size):
+            part = parts[start // self.plan["slice_size"]]
+            crc = existing.get(part.name)
+            if crc is not None and crc == file_crc32c(item["src"], start, size):
+                return
+            with open(item["src"], "rb") as f:
+                f.seek(start)
+                part.upload_from_file(f, size=size, checksum="crc32c")
+
+        self.in_slices(put_slice, slices)
+        self.compose(dest, parts)
+        dest.reload()
+        item["crc32c"] = item["crc32c"] or file_crc32c(item["src"])
+        if dest.crc32c != item["crc32c"]:
+            raise Exception(f"CRC32C mismatch {dest.crc32c} != {item['crc32c']}")
+
+    def compose(self, dest, parts):
+        """compose dest from parts, through intermediate objects if there are
+        more than one compose request takes. The parts are deleted after.
+        """
+        temps = []
+        level = 0
+        while len(parts) > COMPOSE_MAX:
+            level += 1
+            groups = [
+                parts[i : i + COMPOSE_MAX] for i in range(0, len(parts), COMPOSE_MAX)
+            ]
+            composed = []
+            for i, group in enumerate(groups):
+                name = f"{dest.name}{PART_INFIX}l{level}-{i:05d}"
+                blob = dest.bucket.blob(name)
+                blob.compose(group)
+                composed.append(blob)
+            temps.extend(composed)
+            parts = composed
+        dest.compose(parts)
+        for blob in self.client.list_blobs(
+            dest.bucket, prefix=dest.name + PART_INFIX
+        ):
+            blob.delete()
+
+
+def list_source(client, src):
+    """(relative path, size, crc32c, generation) of the files under src, a
+    single file has an empty relative path
+    """
+    if is_gcs(src):
+        bucket, name = split_gcs(src)
+        blob = client.bucket(bucket).get_blob(name) if name else None
+        if blob is not None:
+            return [("", blob.size, blob.crc32c, blob.generation)]
+        prefix = name.rstrip("/") + "/" if name else ""
+        return [
+            (blob.name[len(prefix) :], blob.size, blob.crc32c, blob.generation)
+            for blob in client.list_blobs(bucket, prefix=prefix)
+            if not blob.name.endswith("/") and PART_INFIX not in blob.name
+        ]
+    path = Path(src)
+    if path.is_file():
+        return [("", path.stat().st_size, None, None)]
+    return [
+        (str(p.relative_to(path)), p.stat().st_size, None, None)
+        for p in sorted(path.rglob("*"))
+        if p.is_file() and not p.name.endswith(STAGING_FILES)
+    ]
+
+
+def join(base, rel):
+    if not rel:
+        return base
+    return f"{base.rstrip('/')}/{rel}"
+
+
+def make_plan(args, ntasks):
+    """the files to copy, each assigned to one of ntasks tasks"""
+    client = storage.Client()
+    files = list_source(client, args.src)
+    if not files:
+        raise Exception(f"nothing to copy at {args.src}")
+    single = files[0][0] == ""
+    dest = args.dest
+    if single and (dest.endswith("/") or (not is_gcs(dest) and Path(dest).is_dir())):
+        dest = join(dest, args.src.rstrip("/").rpartition("/")[2])
+    plan = {
+        "slice_size": args.slice_size * MiB,
+        "sliced_threshold": args.sliced_threshold * MiB,
+        "files": [],
+    }
+    # largest first to the task with the fewest bytes, to balance the tasks
+    loads = [0] * ntasks
+    for rel, size, crc, generation in sorted(files, key=lambda f: -f[1]):
+        task = loads.index(min(loads))
+        loads[task] += size
+        plan["files"].append(
+            {
+                "src": join(args.src, rel),
+                "dest": join(dest, rel),
+                "size": size,
+                "crc32c": crc,
+                "generation": generation,
+                "task": task,
+            }
+        )
+    return plan
+
+
+def allocated_nodes():
+    """the number of nodes of the job allocation, 0 outside of one"""
+    if "SLURM_JOB_ID" not in os.environ or "SLURM_JOB_NODELIST" not in os.environ:
+        return 0
+    nodes = os.environ.get("SLURM_JOB_NUM_NODES") or os.environ.get("SLURM_NNODES")
+    return int(nodes or 1)
+
+
+def run_tasks(args, plan, nodes):
+    """copy the plan with one task per allocated node"""
+    job_id = os.environ["SLURM_JOB_ID"]
+    plan_file = Path(f"/tmp/stage-plan-{job_id}-{os.getpid()}.json")
+    plan_file.write_text(json.dumps(plan))
+    try:
+        # the plan may not be on shared storage, give every node a copy
+        subprocess.run(["sbcast", "--force", plan_file, plan_file], check=True)
+        cmd = [
+            "srun",
+            f"--nodes={nodes}",
+            f"--ntasks={nodes}",
+            "--ntasks-per-node=1",
+            sys.executable,
+            __file__,
+            f"--threads={args.threads}",
+            f"--worker={plan_file}",
+        ]
+        return subprocess.run(cmd).returncode
+    finally:
+        plan_file.unlink()
+
+
+def main(args):
+    if args.worker:
+        plan = json.loads(Path(args.worker).read_text())
+        task = int(os.environ.get("SLURM_PROCID", 0))
+        items = [item for item in plan["files"] if item["task"] == task]
+        return 1 if Stager(plan, args.threads).run(items) else 0
+
+    nodes = allocated_nodes() if not args.local else 0
+    start = monotonic()
+    plan = make_plan(args, max(nodes, 1))
+    total = sum(item["size"] for item in plan["files"])
+    print(
+        f"staging {len(plan['files'])} files, {total / MiB:.1f} MiB, "
+        f"from {args.src} to {args.dest} on {max(nodes, 1)} nodes",
+        flush=True,
+    )
+    if nodes > 1:
+        returncode = run_tasks(args, plan, nodes)
+    else:
+        returncode = 1 if Stager(plan, args.threads).run(plan["files"]) else 0
+    elapsed = monotonic() - start
+    print(
+        f"staged {args.src} to {args.dest} in {elapsed:.1f}s "
+        f"({total / MiB / elapsed if elapsed else 0:.1f} MiB/s including unchanged)",
+        flush=True,
+    )
+    return returncode
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter
+    )
+    parser.add_argument("src", nargs="?", help="gs:// uri or local path to copy")
+    parser.add_argument("dest", nargs="?", help="gs:// uri or local path to copy to")
+    parser.add_argument(
+        "--threads", type=int, default=16, help="transfers at once per node"
+    )
+    parser.add_argument(
+        "--slice-size", type=int, default=256, help="MiB per slice of large files"
+    )
+    parser.add_argument(
+        "--sliced-threshold",
+        type=int,
+        default=1024,
+        help="MiB from which files are transferred in slices",
+    )
+    parser.add_argument(
+        "--local", action="store_true", help="copy on this node only, without srun"
+    )
+    parser.add_argument("--worker", help=argparse.SUPPRESS)
+    parser.add_argument("--debug", action="store_true", help="log every file")
+    args = parser.parse_args()
+    if not args.worker and not (args.src and args.dest):
+        parser.error("src and dest are required")
+
+    logging.basicConfig(
+        level=logging.DEBUG if args.debug else logging.WARNING,
+        format="%(asctime)s %(levelname)s: %(message)s",
+    )
+    sys.exit(main(args))
@@ -26,4 +26,5 @@ then
 	exit 1
 fi
 
-gsutil cp $MIGRATE_SRC $MIGRATE_DEST
+# sbatch runs a copy of this script from the spool directory
+exec python3 /slurm/jobs/data_migrate/stage.py $MIGRATE_ARGS "$MIGRATE_SRC" "$MIGRATE_DEST"
@@ -55,6 +55,10 @@ tags = [
 # install_lustre = false
 # install_gcsfuse = false
 
+# Bake the compute setup of a nodeset into the image, from the cluster files
+# bake_nodeset     = "<NODESET_NAME>"
+# bake_bucket_path = "gs://<BUCKET_NAME>/<CLUSTER_PATH>"
+
 ### Service Account ###
 
 service_account_email = "default"
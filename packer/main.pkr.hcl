@@ -31,6 +31,13 @@ locals {
     install_ompi    = var.install_ompi
     install_lustre  = var.install_lustre
     install_gcsfuse = var.install_gcsfuse
+    bake_nodeset    = var.bake_nodeset
+  }
+
+  # the build instance reads the cluster config like a compute node to bake it
+  bake_metadata = var.bake_nodeset == null ? {} : {
+    slurm_bucket_path   = var.bake_bucket_path
+    slurm_instance_role = "compute"
   }
 
   parse_version = regex("^(?P<major>\\d+)(?:\\.(?P<minor>\\d+))?(?:\\.(?P<patch>\\d+))?|(?P<branch>\\w+)$", var.slurmgcp_version)
@@ -104,14 +111,14 @@ source "googlecompute" "image" {
   on_host_maintenance = var.on_host_maintenance
 
   ### metadata ###
-  metadata = {
+  metadata = merge(local.bake_metadata, {
     block-project-ssh-keys = "TRUE"
     shutdown-script        = <<-EOT
       #!/bin/bash
       userdel -r ${var.ssh_username}
       sed -i '/${var.ssh_username}/d' /var/lib/google/google_users
     EOT
-  }
+  })
 
   state_timeout = "10m"
 }
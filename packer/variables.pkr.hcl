@@ -169,6 +169,22 @@ variable "install_gcsfuse" {
   default     = true
 }
 
+variable "bake_nodeset" {
+  description = <<-EOD
+    Nodeset to bake the compute setup of into the image, from the cluster config
+    in bake_bucket_path. Compute nodes booting the image skip the setup steps
+    whose inputs did not change since.
+    EOD
+  type        = string
+  default     = null
+}
+
+variable "bake_bucket_path" {
+  description = "Bucket path of the cluster files, as slurm_bucket_path of the cluster instances. Required with bake_nodeset."
+  type        = string
+  default     = null
+}
+
 ######################
 # BUILD VM VARIABLES #
 ######################
@@ -17,6 +17,7 @@
 from itertools import chain
 from addict import Dict as NSDict
 from collections import defaultdict
+from enum import IntEnum
 import json
 from pathlib import Path
 import util
@@ -38,6 +39,26 @@ FILE_PREAMBLE = """
 login_nodeset = "x-login"
 
 
+class ConfAction(IntEnum):
+    """ways to apply a conf change, from least to most disruptive"""
+
+    NONE = 0
+    UPDATE = 1  # scontrol update of the changed partitions
+    RECONFIGURE = 2  # scontrol reconfigure
+    RESTART = 3  # restart slurmctld
+
+
+# action to apply a change to the generated files other than cloud.conf,
+# slurmdbd.conf is applied by restarting slurmdbd instead
+CONF_FILE_ACTIONS = {
+    "slurm.conf": ConfAction.RESTART,
+    "cgroup.conf": ConfAction.RECONFIGURE,
+    "cloud_gres.conf": ConfAction.RESTART,
+    "cloud_topology.conf": ConfAction.RESTART,
+    "slurmdbd.conf": ConfAction.NONE,
+}
+
+
 def dict_to_conf(conf, delim=" "):
     """convert dict to delimited slurm-style key-value pairs"""
 
@@ -52,6 +73,76 @@ def dict_to_conf(conf, delim=" "):
     )
 
 
+def write_conf(conf_file, content):
+    """write content to conf_file unless it already has that content"""
+    conf_file = Path(conf_file)
+    if conf_file.exists() and conf_file.read_text() == content:
+        return False
+    conf_file.write_text(content)
+    return True
+
+
+def read_confs(lkp=lkp):
+    """contents of the generated conf files, None if missing"""
+    etc = Path(lkp.cfg.output_dir or slurmdirs.etc)
+    return {
+        name: (etc / name).read_text() if (etc / name).exists() else None
+        for name in chain(CONF_FILE_ACTIONS, ["cloud.conf"])
+    }
+
+
+def conf_keys(line):
+    return {pair.split("=", 1)[0].lower() for pair in line.split()}
+
+
+def cloud_conf_action(old, new):
+    """least disruptive action to apply a change of cloud.conf from old to
+    new, with the partition lines to give to scontrol update
+    """
+    if old is None:
+        return ConfAction.RESTART, []
+
+    def split(content):
+        partitions, others = {}, set()
+        for line in filter(None, map(str.strip, content.splitlines())):
+            if line.startswith("#"):
+                continue
+            if line.startswith("PartitionName="):
+                partitions[line.split()[0]] = line
+            else:
+                others.add(line)
+        return partitions, others
+
+    old_parts, old_others = split(old)
+    new_parts, new_others = split(new)
+    changed = old_others ^ new_others
+    if any(line.startswith("NodeName=") for line in changed):
+        # nodes can only be added, removed or redefined with a restart
+        return ConfAction.RESTART, []
+    if changed or old_parts.keys() != new_parts.keys():
+        return ConfAction.RECONFIGURE, []
+    updates = [line for name, line in new_parts.items() if line != old_parts[name]]
+    if any(conf_keys(old_parts[line.split()[0]]) - conf_keys(line) for line in updates):
+        # scontrol update cannot unset a partition option
+        return ConfAction.RECONFIGURE, []
+    return (ConfAction.UPDATE if updates else ConfAction.NONE), updates
+
+
+def conf_action(old_confs, new_confs):
+    """least disruptive action to apply the change from old_confs to
+    new_confs, as from read_confs(), with the partition updates it needs
+    """
+    action, updates = cloud_conf_action(
+        old_confs.get("cloud.conf"), new_confs.get("cloud.conf") or ""
+    )
+    for name, file_action in CONF_FILE_ACTIONS.items():
+        if old_confs.get(name) != new_confs.get(name):
+            action = max(action, file_action)
+    if action > ConfAction.UPDATE:
+        updates = []
+    return action, updates
+
+
 def check_nodeset(nodeset, lkp=lkp):
     tpu = TPU(nodeset)
     return tpu.check_node_type() and tpu.check_tf_version()
@@ -305,7 +396,7 @@ def gen_cloud_conf(lkp=lkp, cloud_parameters=None):
     content = make_cloud_conf(lkp, cloud_parameters=cloud_parameters)
 
     conf_file = Path(lkp.cfg.output_dir or slurmdirs.etc) / "cloud.conf"
-    conf_file.write_text(content)
+    write_conf(conf_file, content)
     util.chown_slurm(conf_file, mode=0o644)
 
 
@@ -330,7 +421,7 @@ def install_slurm_conf(lkp=lkp):
     conf = conf_resp.format(**conf_options)
 
     conf_file = Path(lkp.cfg.output_dir or slurmdirs.etc) / "slurm.conf"
-    conf_file.write_text(conf)
+    write_conf(conf_file, conf)
     util.chown_slurm(conf_file, mode=0o644)
 
 
@@ -368,7 +459,7 @@ def install_slurmdbd_conf(lkp=lkp):
     conf = conf_resp.format(**conf_options)
 
     conf_file = Path(lkp.cfg.output_dir or slurmdirs.etc) / "slurmdbd.conf"
-    conf_file.write_text(conf)
+    write_conf(conf_file, conf)
     util.chown_slurm(conf_file, 0o600)
 
 
@@ -377,7 +468,7 @@ def install_cgroup_conf(lkp=lkp):
     conf = blob_get("slurm-tpl-cgroup-conf").download_as_text()
 
     conf_file = Path(lkp.cfg.output_dir or slurmdirs.etc) / "cgroup.conf"
-    conf_file.write_text(conf)
+    write_conf(conf_file, conf)
     util.chown_slurm(conf_file, mode=0o600)
 
 
@@ -397,7 +488,7 @@ def install_jobsubmit_lua(lkp=lkp):
         conf = conf_resp.format(**conf_options)
 
         conf_file = Path(lkp.cfg.output_dir or slurmdirs.etc) / "job_submit.lua"
-        conf_file.write_text(conf)
+        write_conf(conf_file, conf)
         util.chown_slurm(conf_file, 0o600)
 
 
@@ -426,7 +517,7 @@ def gen_cloud_gres_conf(lkp=lkp):
     content = FILE_PREAMBLE + "\n".join(lines)
 
     conf_file = Path(lkp.cfg.output_dir or slurmdirs.etc) / "cloud_gres.conf"
-    conf_file.write_text(content)
+    write_conf(conf_file, content)
     util.chown_slurm(conf_file, mode=0o600)
 
 
@@ -525,7 +616,7 @@ def gen_topology_conf(lkp=lkp):
     content = FILE_PREAMBLE + "\n".join(lines)
 
     conf_file = Path(lkp.cfg.output_dir or slurmdirs.etc) / "cloud_topology.conf"
-    conf_file.write_text(content)
+    write_conf(conf_file, content)
     util.chown_slurm(conf_file, mode=0o600)
 
 
@@ -1,19 +1,24 @@
 #!/usr/bin/env python3
 
 import argparse
+import json
 import os
-import shelve
+import shlex
+import subprocess
 import uuid
 from collections import namedtuple
 from datetime import datetime, timezone, timedelta
+from itertools import islice
 from pathlib import Path
-from pprint import pprint
 
 from google.cloud.bigquery import SchemaField
 from google.cloud import bigquery as bq
+from google.cloud import bigquery_storage_v1
+from google.cloud.bigquery_storage_v1 import types as bqs_types, writer
 from google.api_core import retry, exceptions
+from google.protobuf import descriptor_pb2, descriptor_pool, message_factory
 
-from util import run
+from util import chunked
 from util import cfg
 from util import def_creds
 
@@ -31,9 +36,16 @@ timestamp_file = Path(os.environ.get("TIMESTAMP_FILE", DEFAULT_TIMESTAMP_FILE))
 # cluster_id = uuid.uuid4().hex
 # cluster_id_file.write_text(cluster_id)
 
+# dedup cache of earlier versions, checkpoints with stream offsets replace it
 job_idx_cache_path = script.parent / "bq_job_idx_cache"
 
 SLURM_TIME_FORMAT = r"%Y-%m-%dT%H:%M:%S"
+BQ_DATETIME_FORMAT = r"%Y-%m-%d %H:%M:%S"
+# rows per AppendRows request, well below its 10MB limit
+BATCH_SIZE = 500
+# jobs may reach the slurm database after they end, only load windows that
+# ended this long ago
+SETTLE_TIME = timedelta(minutes=10)
 
 
 def make_datetime(time_string):
@@ -162,15 +174,50 @@ job_schema = {field.name: field for field in schema_fields}
 Job = namedtuple("Job", job_schema.keys())
 
 client = bq.Client(project=cfg.project, credentials=def_creds)
+write_client = bigquery_storage_v1.BigQueryWriteClient(credentials=def_creds)
 dataset_id = f"{cfg.slurm_cluster_name}_job_data"
+table_id = f"jobs_{cfg.slurm_cluster_name}"
 dataset = bq.DatasetReference(project=cfg.project, dataset_id=dataset_id)
-table = bq.Table(
-    bq.TableReference(dataset, f"jobs_{cfg.slurm_cluster_name}"), schema_fields
-)
+table = bq.Table(bq.TableReference(dataset, table_id), schema_fields)
+table_path = write_client.table_path(cfg.project, dataset_id, table_id)
+
+proto_types = {
+    "DATETIME": descriptor_pb2.FieldDescriptorProto.TYPE_STRING,
+    "STRING": descriptor_pb2.FieldDescriptorProto.TYPE_STRING,
+    "INT64": descriptor_pb2.FieldDescriptorProto.TYPE_INT64,
+}
+
+
+def make_row_descriptor():
+    """proto2 descriptor of a job row for the Storage Write API, optional
+    fields left unset are written as NULL
+    """
+    row = descriptor_pb2.DescriptorProto(name="JobRow")
+    for number, field in enumerate(schema_fields, start=1):
+        row.field.add(
+            name=field.name,
+            number=number,
+            type=proto_types[field.field_type],
+            label=descriptor_pb2.FieldDescriptorProto.LABEL_OPTIONAL,
+        )
+    return row
 
 
-class JobInsertionFailed(Exception):
-    pass
+def make_row_class(row_descriptor):
+    file_proto = descriptor_pb2.FileDescriptorProto(
+        name="slurm_gcp_job_row.proto", package="slurm_gcp", syntax="proto2"
+    )
+    file_proto.message_type.add().CopyFrom(row_descriptor)
+    pool = descriptor_pool.DescriptorPool()
+    pool.Add(file_proto)
+    descriptor = pool.FindMessageTypeByName("slurm_gcp.JobRow")
+    if hasattr(message_factory, "GetMessageClass"):
+        return message_factory.GetMessageClass(descriptor)
+    return message_factory.MessageFactory(pool).GetPrototype(descriptor)
+
+
+row_descriptor = make_row_descriptor()
+JobRow = make_row_class(row_descriptor)
 
 
 def make_job_row(job):
@@ -185,7 +232,19 @@ def make_job_row(job):
     return job_row
 
 
+def serialize_job_row(job_row):
+    row = JobRow()
+    for field_name, value in job_row.items():
+        if isinstance(value, datetime):
+            value = value.strftime(BQ_DATETIME_FORMAT)
+        setattr(row, field_name, value)
+    return row.SerializeToString()
+
+
 def load_slurm_jobs(start, end):
+    """job rows ended in the window from start to end, streamed from sacct in
+    its output order, which is stable for a window that has settled
+    """
     states = ",".join(
         (
             "BOOT_FAIL",
@@ -210,18 +269,14 @@ def load_slurm_jobs(start, end):
         f"{SACCT} --start {start_iso} --end {end_iso} -X -D --format={slurm_fields} "
         f"--state={states} --parsable2 --noheader --allusers --duplicates"
     )
-    text = run(cmd).stdout.splitlines()
-    # zip pairs bq_fields with the value from sacct
-    jobs = [dict(zip(bq_fields, line.split("|"))) for line in text]
-
-    # The job index cache allows us to avoid sending duplicate jobs. This avoids a race condition with updating the database.
-    with shelve.open(str(job_idx_cache_path), flag="r") as job_idx_cache:
-        job_rows = [
-            make_job_row(job)
-            for job in jobs
-            if str(job["job_db_uuid"]) not in job_idx_cache
-        ]
-    return job_rows
+    with subprocess.Popen(
+        shlex.split(cmd), stdout=subprocess.PIPE, universal_newlines=True
+    ) as proc:
+        for line in proc.stdout:
+            # zip pairs bq_fields with the value from sacct
+            yield make_job_row(dict(zip(bq_fields, line.rstrip("\n").split("|"))))
+    if proc.returncode:
+        raise subprocess.CalledProcessError(proc.returncode, cmd)
 
 
 def init_table():
@@ -236,59 +291,126 @@ def init_table():
     table = client.update_table(table, ["schema"])
 
 
-def purge_job_idx_cache():
-    purge_time = datetime.now() - timedelta(minutes=30)
-    with shelve.open(str(job_idx_cache_path), writeback=True) as cache:
-        to_delete = []
-        for idx, stamp in cache.items():
-            if stamp < purge_time:
-                to_delete.append(idx)
-        for idx in to_delete:
-            del cache[idx]
-
-
-def bq_submit(jobs):
-    try:
-        result = client.insert_rows(table, jobs)
-    except exceptions.NotFound as e:
-        print(f"failed to upload job data, table not yet found: {e}")
-        raise e
-    except Exception as e:
-        print(f"failed to upload job data: {e}")
-        raise e
-    if result:
-        pprint(jobs)
-        pprint(result)
-        raise JobInsertionFailed("failed to upload job data to big query")
-    print(f"successfully loaded {len(jobs)} jobs")
-
-
-def get_time_window():
+def read_checkpoint():
+    """the window being loaded, its write stream and how far it got
+    stream is None once the window is fully loaded
+    """
+    checkpoint = {"start": None, "end": None, "stream": None, "offset": 0, "rows": 0}
     if not timestamp_file.is_file():
-        timestamp_file.touch()
+        return checkpoint
+    text = timestamp_file.read_text().rstrip()
     try:
-        timestamp = datetime.strptime(
-            timestamp_file.read_text().rstrip(), SLURM_TIME_FORMAT
-        )
-        # time window will overlap the previous by 10 minutes. Duplicates will be filtered out by the job_idx_cache
-        start = timestamp - timedelta(minutes=10)
+        checkpoint.update(json.loads(text))
     except ValueError:
+        try:
+            # timestamp of earlier versions, the end of the last loaded window
+            datetime.strptime(text, SLURM_TIME_FORMAT)
+            checkpoint["end"] = text
+        except ValueError:
+            pass
+    return checkpoint
+
+
+def write_checkpoint(checkpoint):
+    tmp = timestamp_file.with_name(f".{timestamp_file.name}.tmp")
+    tmp.write_text(json.dumps(checkpoint))
+    tmp.replace(timestamp_file)
+
+
+def new_window(checkpoint):
+    """the next window to load after the checkpoint, None if there is none yet"""
+    if checkpoint["end"]:
+        # sacct includes jobs ending on either bound, so windows must not share one
+        start = datetime.strptime(checkpoint["end"], SLURM_TIME_FORMAT)
+        start += timedelta(seconds=1)
+    else:
         # timestamp 1 is 1 second after the epoch; timestamp 0 is special for sacct
         start = datetime.fromtimestamp(1)
-    # end is now() truncated to the last second
-    end = datetime.now().replace(microsecond=0)
-    return start, end
-
-
-def write_timestamp(time):
-    timestamp_file.write_text(time.isoformat(timespec="seconds"))
+    # end is truncated to the last second
+    end = (datetime.now() - SETTLE_TIME).replace(microsecond=0)
+    if end < start:
+        return None
+    return {
+        "start": start.isoformat(timespec="seconds"),
+        "end": end.isoformat(timespec="seconds"),
+        "stream": None,
+        "offset": 0,
+        "rows": 0,
+    }
 
 
-def update_job_idx_cache(jobs, timestamp):
-    with shelve.open(str(job_idx_cache_path), writeback=True) as job_idx_cache:
-        for job in jobs:
-            job_idx = str(job["job_db_uuid"])
-            job_idx_cache[job_idx] = timestamp
+def create_stream():
+    stream = bqs_types.WriteStream(type_=bqs_types.WriteStream.Type.COMMITTED)
+    return write_client.create_write_stream(parent=table_path, write_stream=stream)
+
+
+def open_stream(checkpoint):
+    """AppendRowsStream of the checkpoint's write stream, created if needed.
+    A stream that expired is replaced, at the risk of duplicating the batch
+    in flight when the last run stopped.
+    """
+    if checkpoint["stream"] is not None:
+        try:
+            write_client.get_write_stream(name=checkpoint["stream"])
+        except exceptions.NotFound:
+            print(f"write stream {checkpoint['stream']} expired, starting a new one")
+            checkpoint["stream"] = None
+    if checkpoint["stream"] is None:
+        checkpoint["stream"] = create_stream().name
+        checkpoint["offset"] = 0
+        # save before the first append, so a retry resumes on the same stream
+        write_checkpoint(checkpoint)
+    template = bqs_types.AppendRowsRequest(
+        write_stream=checkpoint["stream"],
+        proto_rows=bqs_types.AppendRowsRequest.ProtoData(
+            writer_schema=bqs_types.ProtoSchema(proto_descriptor=row_descriptor)
+        ),
+    )
+    return writer.AppendRowsStream(write_client, template)
+
+
+def append_rows(append_stream, offset, rows):
+    """append rows at offset, exactly once: rows already written at that
+    offset by an interrupted run are not written again
+    """
+    request = bqs_types.AppendRowsRequest(
+        offset=offset,
+        proto_rows=bqs_types.AppendRowsRequest.ProtoData(
+            rows=bqs_types.ProtoRows(serialized_rows=list(map(serialize_job_row, rows)))
+        ),
+    )
+    try:
+        append_stream.send(request).result()
+    except exceptions.AlreadyExists:
+        print(f"{len(rows)} jobs at offset {offset} were already loaded")
+
+
+def load_window(checkpoint):
+    """load the jobs of the checkpoint's window in batches, checkpointing
+    after each batch, starting after the rows loaded by an earlier run
+    """
+    start = datetime.strptime(checkpoint["start"], SLURM_TIME_FORMAT)
+    end = datetime.strptime(checkpoint["end"], SLURM_TIME_FORMAT)
+    jobs = islice(load_slurm_jobs(start, end), checkpoint["rows"], None)
+    append_stream = None
+    try:
+        for batch in chunked(jobs, n=BATCH_SIZE):
+            if append_stream is None:
+                append_stream = open_stream(checkpoint)
+            append_rows(append_stream, checkpoint["offset"], batch)
+            checkpoint["offset"] += len(batch)
+            checkpoint["rows"] += len(batch)
+            write_checkpoint(checkpoint)
+    finally:
+        if append_stream is not None:
+            append_stream.close()
+    if checkpoint["stream"] is not None:
+        write_client.finalize_write_stream(name=checkpoint["stream"])
+    print(
+        f"successfully loaded {checkpoint['rows']} jobs from {checkpoint['start']} to {checkpoint['end']}"
+    )
+    checkpoint["stream"] = None
+    write_checkpoint(checkpoint)
 
 
 def main():
@@ -296,16 +418,17 @@ def main():
         print("bigquery load is not currently enabled")
         exit(0)
     init_table()
+    for path in script.parent.glob(f"{job_idx_cache_path.name}*"):
+        path.unlink()
 
-    start, end = get_time_window()
-    jobs = load_slurm_jobs(start, end)
-    # on failure, an exception will cause the timestamp not to be rewritten. So
-    # it will try again next time. If some writes succeed, we don't currently
-    # have a way to not submit duplicates next time.
-    if jobs:
-        bq_submit(jobs)
-    write_timestamp(end)
-    update_job_idx_cache(jobs, end)
+    # on failure, the checkpoint keeps the window, stream and offset reached,
+    # and the next run picks up from there
+    checkpoint = read_checkpoint()
+    if checkpoint["stream"] is not None:
+        load_window(checkpoint)
+    checkpoint = new_window(checkpoint)
+    if checkpoint is not None:
+        load_window(checkpoint)
 
 
 parser = argparse.ArgumentParser(description="submit slurm job data to big query")
@@ -314,10 +437,9 @@ parser.add_argument(
     nargs="?",
     action="store",
     type=Path,
-    help="specify timestamp file for reading and writing the time window start. Precedence over TIMESTAMP_FILE env var.",
+    help="specify checkpoint file for reading and writing the time window loaded. Precedence over TIMESTAMP_FILE env var.",
 )
 
-purge_job_idx_cache()
 if __name__ == "__main__":
     args = parser.parse_args()
     if args.timestamp_file:
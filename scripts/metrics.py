@@ -0,0 +1,256 @@
+# Copyright (C) SchedMD LLC.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Prometheus metrics of the slurm-gcp scripts
+
+Each process counts into its own registry. flush() merges the counts into a
+state file shared by all processes on the host, and renders the totals in
+the Prometheus text format for the node_exporter textfile collector.
+
+Only the standard library may be imported here, util.py imports this.
+"""
+
+import fcntl
+import json
+import logging
+import os
+import threading
+from bisect import bisect_left
+from contextlib import contextmanager
+from pathlib import Path
+from time import monotonic, time
+
+log = logging.getLogger(__name__)
+
+TEXTFILE = "slurm_gcp.prom"
+STATE_FILE = ".slurm_gcp.state.json"
+SECONDS_BUCKETS = (0.1, 0.5, 1, 2.5, 5, 10, 30, 60, 120, 300, 600, 1800)
+SIZE_BUCKETS = (1, 5, 10, 50, 100, 500, 1000, 5000)
+
+# name: (type, help, buckets of a histogram)
+METRICS = {
+    "slurm_gcp_api_requests_total": (
+        "counter",
+        "Compute and TPU API requests sent, by method",
+        None,
+    ),
+    "slurm_gcp_api_retries_total": (
+        "counter",
+        "API requests retried after a rate limit or quota error, by method",
+        None,
+    ),
+    "slurm_gcp_api_errors_total": (
+        "counter",
+        "API requests that failed, by method",
+        None,
+    ),
+    "slurm_gcp_rate_limit_backoffs_total": (
+        "counter",
+        "Rate limit errors that slowed down the shared rate limiter, by api",
+        None,
+    ),
+    "slurm_gcp_rate_limit_wait_seconds_total": (
+        "counter",
+        "Time spent waiting on the shared rate limiter, by api",
+        None,
+    ),
+    "slurm_gcp_bulk_insert_size": (
+        "histogram",
+        "Nodes per bulkInsert request",
+        SIZE_BUCKETS,
+    ),
+    "slurm_gcp_operation_seconds": (
+        "histogram",
+        "Operation latency from insert to done, by operation type",
+        SECONDS_BUCKETS,
+    ),
+    "slurm_gcp_resume_nodes_total": (
+        "counter",
+        "Nodes given to ResumeProgram",
+        None,
+    ),
+    "slurm_gcp_suspend_nodes_total": (
+        "counter",
+        "Nodes given to SuspendProgram",
+        None,
+    ),
+    "slurm_gcp_sync_seconds": (
+        "histogram",
+        "Duration of slurmsync reconciliations, by scope: full or delta",
+        SECONDS_BUCKETS,
+    ),
+    "slurm_gcp_sync_update_seconds": (
+        "histogram",
+        "Duration of slurmsync node updates, by node status",
+        SECONDS_BUCKETS,
+    ),
+    "slurm_gcp_sync_nodes_total": (
+        "counter",
+        "Nodes updated by slurmsync, by node status",
+        None,
+    ),
+    "slurm_gcp_boot_failures_total": (
+        "counter",
+        "Booting nodes powered down after their setup failed, by nodeset",
+        None,
+    ),
+    "slurm_gcp_zone_stockout_nodes_total": (
+        "counter",
+        "Nodes that failed to create for lack of capacity in a zone, by zone",
+        None,
+    ),
+    "slurm_gcp_plugin_hook_seconds": (
+        "histogram",
+        "Duration of slurm_gcp_plugins callbacks, by plugin and hook",
+        SECONDS_BUCKETS,
+    ),
+    "slurm_gcp_template_info_total": (
+        "counter",
+        "Instance template lookups, by source: memory, file cache or api",
+        None,
+    ),
+}
+
+
+def _escape(value):
+    return str(value).replace("\\", "\\\\").replace('"', '\\"').replace("\n", "\\n")
+
+
+def _label_str(labels):
+    return ",".join(f'{k}="{_escape(v)}"' for k, v in sorted(labels.items()))
+
+
+class Registry:
+    """counters and histograms of this process since the last flush"""
+
+    def __init__(self):
+        self._lock = threading.Lock()
+        self._values = {}
+
+    def inc(self, name, value=1, **labels):
+        key = (name, _label_str(labels))
+        with self._lock:
+            self._values[key] = self._values.get(key, 0) + value
+
+    def observe(self, name, value, **labels):
+        """add value to a histogram, counts are kept per bucket plus the sum"""
+        buckets = METRICS[name][2]
+        key = (name, _label_str(labels))
+        with self._lock:
+            counts = self._values.setdefault(key, [0] * (len(buckets) + 2))
+            counts[bisect_left(buckets, value)] += 1
+            counts[-1] += value
+
+    @contextmanager
+    def timer(self, name, **labels):
+        start = monotonic()
+        try:
+            yield
+        finally:
+            self.observe(name, monotonic() - start, **labels)
+
+    def take(self):
+        """the values counted since the last take, as nested dicts"""
+        with self._lock:
+            values, self._values = self._values, {}
+        nested = {}
+        for (name, labels), value in values.items():
+            nested.setdefault(name, {})[labels] = value
+        return nested
+
+
+registry = Registry()
+inc = registry.inc
+observe = registry.observe
+timer = registry.timer
+
+
+def _merge(totals, values):
+    for name, series in values.items():
+        merged = totals.setdefault(name, {})
+        for labels, value in series.items():
+            if isinstance(value, list):
+                old = merged.get(labels, [0] * len(value))
+                merged[labels] = [a + b for a, b in zip(old, value)]
+            else:
+                merged[labels] = merged.get(labels, 0) + value
+
+
+def _braces(*labels):
+    labels = ",".join(filter(None, labels))
+    return f"{{{labels}}}" if labels else ""
+
+
+def render(totals):
+    """totals in the Prometheus text exposition format"""
+    lines = []
+    for name, (kind, text, buckets) in METRICS.items():
+        series = totals.get(name)
+        if not series:
+            continue
+        lines.append(f"# HELP {name} {text}")
+        lines.append(f"# TYPE {name} {kind}")
+        for labels, value in sorted(series.items()):
+            if kind != "histogram":
+                lines.append(f"{name}{_braces(labels)} {value}")
+                continue
+            cumulative = 0
+            for le, count in zip((*buckets, "+Inf"), value):
+                cumulative += count
+                le = f'le="{le}"'
+                lines.append(f"{name}_bucket{_braces(labels, le)} {cumulative}")
+            lines.append(f"{name}_sum{_braces(labels)} {value[-1]}")
+            lines.append(f"{name}_count{_braces(labels)} {cumulative}")
+    name = "slurm_gcp_metrics_flush_timestamp_seconds"
+    lines.append(f"# HELP {name} Time the metrics were last written")
+    lines.append(f"# TYPE {name} gauge")
+    lines.append(f"{name} {time():.3f}")
+    return "\n".join(lines) + "\n"
+
+
+def flush(directory, registry=registry):
+    """merge the registry into the host totals and rewrite the textfile
+    Best effort, metrics are dropped rather than failing the caller.
+    """
+    values = registry.take()
+    if not values or not directory:
+        return
+    directory = Path(directory)
+    try:
+        directory.mkdir(parents=True, exist_ok=True)
+        fd = os.open(directory / STATE_FILE, os.O_RDWR | os.O_CREAT, 0o664)
+    except OSError as e:
+        log.warning(f"failed to write metrics to {directory}: {e}")
+        return
+    try:
+        fcntl.lockf(fd, fcntl.LOCK_EX)
+        with os.fdopen(os.dup(fd), "r+") as f:
+            try:
+                totals = json.load(f)
+            except ValueError:
+                totals = {}
+            _merge(totals, values)
+            f.seek(0)
+            f.truncate()
+            json.dump(totals, f)
+        textfile = directory / TEXTFILE
+        tmp = textfile.with_name(f".{TEXTFILE}.{os.getpid()}")
+        tmp.write_text(render(totals))
+        tmp.chmod(0o644)
+        os.replace(tmp, textfile)
+    except OSError as e:
+        log.warning(f"failed to write metrics to {directory}: {e}")
+    finally:
+        fcntl.lockf(fd, fcntl.LOCK_UN)
+        os.close(fd)
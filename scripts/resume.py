@@ -20,31 +20,44 @@ import collections
 import json
 import logging
 import os
+import re
 import sys
-import yaml
-from itertools import chain
-from pathlib import Path
 
-import util
-from util import (
+if __name__ == "__main__":
+    # hand off to the pre-warmed worker before the slow imports, if it is up
+    try:
+        import worker
+    except ImportError:
+        pass
+    else:
+        worker.forward_or_continue("resume")
+
+import yaml  # noqa: E402
+from concurrent.futures import ThreadPoolExecutor, as_completed  # noqa: E402
+from itertools import chain  # noqa: E402
+from pathlib import Path  # noqa: E402
+from time import time  # noqa: E402
+
+import metrics  # noqa: E402
+import util  # noqa: E402
+from util import (  # noqa: E402
     chunked,
     dirs,
     ensure_execute,
-    execute_with_futures,
     get_insert_operations,
+    hostlists_yaml,
     log_api_request,
-    map_with_futures,
-    run,
+    Lazy,
     separate,
     to_hostlist,
     to_hostnames,
     trim_self_link,
     wait_for_operation,
 )
-from util import cfg, lkp, NSDict, TPU
+from util import cfg, lkp, NSDict, TPU, TPUJob  # noqa: E402
 
 # from util import cfg, lkp, NSDict
-import slurm_gcp_plugins
+import slurm_gcp_plugins  # noqa: E402
 
 
 filename = Path(__file__).name
@@ -54,15 +67,41 @@ log = logging.getLogger(filename)
 
 
 global_resume_data = None
+# scontrol updates collected during a resume, see down_nodes()
+slurm_updates = util.SlurmUpdates()
 
 PLACEMENT_MAX_CNT = 150
 # Placement group needs to be the same for an entire bulk_insert hence
 # if placement is used the actual BULK_INSERT_LIMIT will be
 # max([1000, PLACEMENT_MAX_CNT])
 BULK_INSERT_LIMIT = 5000
+# bulk groups in flight at once, from bulkInsert submission until harvested
+MAX_INFLIGHT_GROUPS = 32
+# insert errors of a zone without capacity for the instances
+STOCKOUT_CODES = frozenset(
+    ["ZONE_RESOURCE_POOL_EXHAUSTED", "ZONE_RESOURCE_POOL_EXHAUSTED_WITH_DETAILS"]
+)
+# zones named in operation error messages
+ZONE_LINK_REGEX = re.compile(r"zones/(?P<zone>[a-z0-9-]+)")
 
 
-def instance_properties(nodeset, model, placement_group, labels=None):
+def label_disks(disks, labels):
+    """add labels to the disks, except local ssd"""
+    for disk in disks:
+        if (
+            "diskType" not in disk.initializeParams
+            or disk.initializeParams.diskType == "local-ssd"
+        ):
+            continue
+        disk.initializeParams.labels.update(labels)
+    return disks
+
+
+def nodeset_instance_properties(nodeset, model, placement_group):
+    """instanceProperties shared by all bulkInserts of a nodeset and placement
+    group. Metadata, labels and disks that the instance template already has
+    right are left out, so they come from sourceInstanceTemplate.
+    """
     template = lkp.node_template(model)
     template_info = lkp.template_info(template)
 
@@ -75,32 +114,27 @@ def instance_properties(nodeset, model, placement_group, labels=None):
             Path(cfg.slurm_scripts_dir or util.dirs.scripts) / "startup.sh"
         ).read_text(),
         "VmDnsSetting": "GlobalOnly",
+        "enable-guest-attributes": "TRUE",
     }
     info_metadata = {
         item.get("key"): item.get("value") for item in template_info.metadata["items"]
     }
-
-    props_metadata = {**info_metadata, **slurm_metadata}
-    props.metadata = {
-        "items": [NSDict({"key": k, "value": v}) for k, v in props_metadata.items()]
-    }
+    if any(info_metadata.get(k) != v for k, v in slurm_metadata.items()):
+        props_metadata = {**info_metadata, **slurm_metadata}
+        props.metadata = {
+            "items": [NSDict({"key": k, "value": v}) for k, v in props_metadata.items()]
+        }
 
     labels = {
         "slurm_cluster_name": cfg.slurm_cluster_name,
         "slurm_instance_role": "compute",
-        **(labels or {}),
     }
-    props.labels = {**template_info.labels, **labels}
+    if not labels.items() <= template_info.labels.items():
+        props.labels = {**template_info.labels, **labels}
 
-    for disk in template_info.disks:
-        # do not label local ssd
-        if (
-            "diskType" not in disk.initializeParams
-            or disk.initializeParams.diskType == "local-ssd"
-        ):
-            continue
-        disk.initializeParams.labels.update(labels)
-    props.disks = template_info.disks
+    disks = label_disks([NSDict(disk) for disk in template_info.disks], labels)
+    if disks != template_info.disks:
+        props.disks = disks
 
     if placement_group:
         props.scheduling = {
@@ -129,6 +163,35 @@ def instance_properties(nodeset, model, placement_group, labels=None):
     return props
 
 
+_nodeset_instance_properties = {}
+
+
+def instance_properties(nodeset, model, placement_group, labels=None):
+    """instanceProperties for a bulkInsert, labels are added per job"""
+    key = (nodeset.nodeset_name, placement_group)
+    if key not in _nodeset_instance_properties:
+        _nodeset_instance_properties[key] = nodeset_instance_properties(
+            nodeset, model, placement_group
+        )
+    props = _nodeset_instance_properties[key]
+    if not labels:
+        return props
+
+    template_info = lkp.template_info(lkp.node_template(model))
+    props = props.deepcopy()
+    props.labels = {**(props.labels or template_info.labels), **labels}
+    disks = props.disks or [NSDict(disk) for disk in template_info.disks]
+    props.disks = label_disks(
+        disks,
+        {
+            "slurm_cluster_name": cfg.slurm_cluster_name,
+            "slurm_instance_role": "compute",
+            **labels,
+        },
+    )
+    return props
+
+
 def per_instance_properties(node):
     props = NSDict()
     # No properties beyond name are supported yet.
@@ -165,9 +228,12 @@ def create_instances_request(nodes, partition_name, placement_group, job_id=None
         else None
     )
     # overwrites properties across all instances
-    body.instanceProperties = instance_properties(
-        nodeset, model, placement_group, labels
-    )
+    props = instance_properties(nodeset, model, placement_group, labels)
+    if lkp.cfg.enable_slurm_gcp_plugins:
+        # plugins may modify the body, keep the shared properties intact
+        props = props.deepcopy()
+    if props:
+        body.instanceProperties = props
 
     # key is instance name, value overwrites properties
     body.perInstanceProperties = {k: per_instance_properties(k) for k in nodes}
@@ -182,7 +248,12 @@ def create_instances_request(nodes, partition_name, placement_group, job_id=None
             for zone in nodeset.zone_policy_deny or []
         },
     }
-    body.locationPolicy.targetShape = cfg.zone_target_shape or "ANY_SINGLE_ZONE"
+    # keep out of zones that recently ran out of capacity
+    for zone in stockout_zones(nodeset):
+        zones[f"zones/{zone}"] = {"preference": "DENY"}
+    body.locationPolicy.targetShape = (
+        nodeset.zone_target_shape or cfg.zone_target_shape or "ANY_SINGLE_ZONE"
+    )
     if zones:
         body.locationPolicy.locations = zones
 
@@ -198,22 +269,32 @@ def create_instances_request(nodes, partition_name, placement_group, job_id=None
         project=cfg.project, region=region, body=body.to_dict()
     )
 
-    if log.isEnabledFor(logging.DEBUG):
-        log.debug(
-            f"new request: endpoint={request.methodId} nodes={to_hostlist(nodes)}"
-        )
+    log.debug(
+        "new request: endpoint=%s nodes=%s",
+        request.methodId,
+        Lazy(to_hostlist, nodes),
+    )
     log_api_request(request)
     return request
 
 
+def stockout_zones(nodeset):
+    """allowed zones of nodeset that ran out of capacity recently, none if
+    that is all of them
+    """
+    if not cfg.zone_stockout_ttl:
+        return set()
+    allowed = lkp.nodeset_allowed_zones(nodeset)
+    stocked = allowed.intersection(lkp.zone_stockouts())
+    return stocked if stocked != allowed else set()
+
+
 def expand_nodelist(nodelist):
     """expand nodes in hostlist to hostnames"""
     if not nodelist:
         return []
 
-    # TODO use a python library instead?
-    nodes = run(f"{lkp.scontrol} show hostnames {nodelist}").stdout.splitlines()
-    return nodes
+    return to_hostnames(nodelist)
 
 
 def group_nodes_bulk(nodes, resume_data=None):
@@ -224,6 +305,9 @@ def group_nodes_bulk(nodes, resume_data=None):
     else:
         jobs = {job.job_id: job for job in resume_data.jobs}
 
+    # placement groups of all jobs are created together, below
+    to_create = {}
+
     # expand all job nodelists
     for job in jobs.values():
         job.nodelist_alloc = job.nodes_alloc
@@ -233,10 +317,11 @@ def group_nodes_bulk(nodes, resume_data=None):
         job.tpu = util.part_is_tpu(job.partition)
         if not job.tpu:
             # create placement groups if nodes for job need it
-            job.placement_groups = create_placement_groups(
+            job.placement_groups, pg_regions = plan_placement_groups(
                 node_list=job.nodes_alloc,
                 job_id=job.job_id,
             )
+            to_create.update(pg_regions)
             # placement group assignment is based on all allocated nodes, but we only want to
             # handle nodes in nodes_resume in this run.
             for pg, pg_nodes in job.placement_groups.items():
@@ -255,11 +340,15 @@ def group_nodes_bulk(nodes, resume_data=None):
             jobless_nodes.remove(jobless_node)
             jobless_nodes_tpu.append(jobless_node)
 
+    jobless_groups, pg_regions = plan_placement_groups(node_list=jobless_nodes)
+    to_create.update(pg_regions)
+    insert_placement_groups(to_create)
+
     jobs["Normal_None"] = NSDict(
         job_id=None,
         nodes_resume=jobless_nodes,
         nodes_alloc=jobless_nodes,
-        placement_groups=create_placement_groups(node_list=jobless_nodes),
+        placement_groups=jobless_groups,
         partition=None,
         tpu=False,
     )
@@ -325,32 +414,97 @@ def group_nodes_bulk(nodes, resume_data=None):
     return grouped_nodes, grouped_nodes_tpu
 
 
-def start_tpu(data):
-    tpu = data["tpu"]
-    node = data["node"]
-    if len(node) == 1:
+def start_tpu_jobs(tpu_start_data):
+    """TPUJobs that create the given TPU slices, or start preserved ones"""
+    jobs = []
+    zone_nodes = {}
+    for data in tpu_start_data:
+        tpu = data["tpu"]
+        node = data["node"]
+        if len(node) > 1:
+            log.debug(
+                f"Will create a multi-vm TPU of type {tpu.node_type} tf_version {tpu.tf_version} in zone {tpu.zone} with name {node[0]}"
+            )
+            jobs.append(TPUJob(tpu, "create", node))
+            continue
         node = node[0]
         log.debug(
             f"Will create a TPU of type {tpu.node_type} tf_version {tpu.tf_version} in zone {tpu.zone} with name {node}"
         )
-        tpunode = tpu.get_node(node)
-        if tpunode is None:
-            if not tpu.create_node(nodename=node):
-                log.error("Error creating tpu node {node}")
+        # one list per zone instead of a get per node
+        if tpu.zone not in zone_nodes:
+            zone_nodes[tpu.zone] = set(tpu.list_node_names())
+        if node not in zone_nodes[tpu.zone]:
+            jobs.append(TPUJob(tpu, "create", node))
+        elif tpu.preserve_tpu:
+            jobs.append(TPUJob(tpu, "start", node))
         else:
-            if tpu.preserve_tpu:
-                if not tpu.start_node(nodename=node):
-                    log.error("Error starting tpu node {node}")
-            else:
-                log.info(
-                    f"Tpu node {node} is already created, but will not start it because nodeset does not have preserve_tpu option active."
-                )
-    else:
-        log.debug(
-            f"Will create a multi-vm TPU of type {tpu.node_type} tf_version {tpu.tf_version} in zone {tpu.zone} with name {node[0]}"
+            log.info(
+                f"Tpu node {node} is already created, but will not start it because nodeset does not have preserve_tpu option active."
+            )
+    return jobs
+
+
+def start_tpus(tpu_start_data):
+    """create or start TPU slices, all at once"""
+    if tpu_start_data:
+        util.run_tpu_jobs(start_tpu_jobs(tpu_start_data))
+
+
+def start_boot_timing(submitted, ops):
+    """start the boot timing records of nodes, from their finished create or
+    start operations. slurmsync completes them once the nodes are up.
+    """
+    for node, op in ops.items():
+        phases = {"resume": submitted}
+        if "endTime" in op:
+            phases["created"] = util.parse_gcp_timestamp(op["endTime"])
+        lkp.boot_timing.set(
+            node, {"nodeset": lkp.node_nodeset_name(node), "phases": phases}
         )
-        if not tpu.create_node(nodename=node):
-            log.error("Error creating tpu node {node}")
+
+
+def take_pooled_nodes(nodes):
+    """the nodes with an instance in the warm pool. They stay pooled until
+    resume_pooled_instances has started their instances
+    """
+    pool = lkp.warm_pool()
+    pooled = [node for node in nodes if node in pool]
+    if not pooled:
+        return []
+    lkp.instances(fields=())
+    gone = [node for node in pooled if lkp.instance(node) is None]
+    lkp.unpool_nodes(gone)
+    return [node for node in pooled if lkp.instance(node) is not None]
+
+
+def resume_instance_request(node):
+    """start a stopped instance, or resume a suspended one"""
+    inst = lkp.instance(node)
+    if inst.status in ("SUSPENDING", "SUSPENDED"):
+        method = util.compute.instances().resume
+    else:
+        method = util.compute.instances().start
+    request = method(project=cfg.project, zone=inst.zone, instance=node)
+    log_api_request(request)
+    return request
+
+
+def resume_pooled_instances(nodes):
+    """bring back pooled instances, down the nodes that fail
+    returns the nodes that were resumed
+    """
+    log.info(f"resume {len(nodes)} pooled instances ({to_hostlist(nodes)})")
+    requests = {node: resume_instance_request(node) for node in nodes}
+    submitted = time()
+    resumed, errors = util.batch_execute_wait(requests)
+    # failed nodes are downed, their instances are not reused either
+    lkp.unpool_nodes(nodes)
+    start_boot_timing(submitted, resumed)
+    for err, failed in util.groupby_unsorted(list(errors), lambda n: str(errors[n])):
+        log.error(f"pooled instances failed to resume: {err} ({to_hostlist(failed)})")
+        down_nodes(list(failed), f"GCP Error: {err}")
+    return set(resumed)
 
 
 def resume_nodes(nodes, resume_data=None):
@@ -368,24 +522,27 @@ def resume_nodes(nodes, resume_data=None):
 
     nodes = sorted(nodes, key=lkp.node_prefix)
     grouped_nodes, grouped_tpu_nodes = group_nodes_bulk(nodes, resume_data)
-
-    if log.isEnabledFor(logging.DEBUG):
-        # grouped_nodelists is used in later debug logs too
-        grouped_nodelists = {
-            group: to_hostlist(chunk.nodes) for group, chunk in grouped_nodes.items()
+    # pooled instances are brought back, only the shortfall is created
+    pooled = set(take_pooled_nodes(nodes))
+    if pooled:
+        grouped_nodes = {
+            group: chunk._replace(nodes=[n for n in chunk.nodes if n not in pooled])
+            for group, chunk in grouped_nodes.items()
         }
-        grouped_tpu_nodelists = {
-            group: to_hostlist(chunk.nodes)
-            for group, chunk in grouped_tpu_nodes.items()
+        grouped_nodes = {
+            group: chunk for group, chunk in grouped_nodes.items() if chunk.nodes
         }
-        log.debug(
-            "node bulk groups: \n{}".format(yaml.safe_dump(grouped_nodelists).rstrip())
-        )
-        log.debug(
-            "TPU node bulk groups: \n{}".format(
-                yaml.safe_dump(grouped_tpu_nodelists).rstrip()
-            )
-        )
+
+    log.debug(
+        "node bulk groups: \n%s",
+        Lazy(hostlists_yaml, {group: c.nodes for group, c in grouped_nodes.items()}),
+    )
+    log.debug(
+        "TPU node bulk groups: \n%s",
+        Lazy(
+            hostlists_yaml, {group: c.nodes for group, c in grouped_tpu_nodes.items()}
+        ),
+    )
     tpu_start_data = []
     tpu_objs = {}
     for group, chunk in grouped_tpu_nodes.items():
@@ -396,7 +553,7 @@ def resume_nodes(nodes, resume_data=None):
 
         tpu_start_data.append({"tpu": tpu_objs[chunk.prefix], "node": chunk.nodes})
 
-    # make all bulkInsert requests and execute with batch
+    # make all bulkInsert requests up front so request errors fail fast
     inserts = {
         group: create_instances_request(
             chunk.nodes, chunk.partition_name, chunk.placement_group, chunk.job_id
@@ -404,79 +561,171 @@ def resume_nodes(nodes, resume_data=None):
         for group, chunk in grouped_nodes.items()
     }
 
-    bulk_ops = dict(
-        zip(inserts.keys(), map_with_futures(ensure_execute, inserts.values()))
+    # each group is submitted, waited on and harvested on its own so one slow
+    # group does not hold back the others
+    try:
+        with ThreadPoolExecutor(max_workers=MAX_INFLIGHT_GROUPS) as exe:
+            futures = [
+                exe.submit(resume_bulk_group, group, grouped_nodes[group], insert)
+                for group, insert in inserts.items()
+            ]
+            if pooled:
+                futures.append(exe.submit(resume_pooled_instances, sorted(pooled)))
+            # Start TPU alongside, on their own threads, so that regular nodes
+            # are not affected by the slower TPU nodes
+            log.debug("tpu_start_data=%s", Lazy(yaml.safe_dump, tpu_start_data))
+            start_tpus(tpu_start_data)
+            for future in as_completed(futures):
+                future.result()
+    finally:
+        # down the failed nodes and comment their jobs in as few calls as possible
+        slurm_updates.apply()
+
+
+def resume_bulk_group(group, chunk, insert, attempt=0):
+    """submit the bulkInsert of a node group, wait for it to complete, then
+    down the nodes that failed to create
+    With zone_stockout_ttl, nodes without a placement group that failed for
+    lack of zone capacity are retried in the other zones first.
+    returns the nodes that were created
+    """
+    submitted = time()
+    metrics.observe("slurm_gcp_bulk_insert_size", len(chunk.nodes))
+    try:
+        op = ensure_execute(insert)
+    except Exception as e:
+        reason = e._get_reason() if hasattr(e, "_get_reason") else str(e)
+        log.error(f"bulkInsert API failures: {group}: {e}")
+        down_nodes(chunk.nodes, f"GCP Error: {reason}")
+        return set()
+
+    group_id = op["operationGroupId"]
+    log.debug(
+        "new bulkInsert operation started: group=%s nodes=%s name=%s operationGroupId=%s",
+        group,
+        Lazy(to_hostlist, chunk.nodes),
+        op["name"],
+        group_id,
     )
-    log.debug(f"bulk_ops={yaml.safe_dump(bulk_ops)}")
-    started = {
-        group: op for group, op in bulk_ops.items() if not isinstance(op, Exception)
-    }
-    failed = {
-        group: err for group, err in bulk_ops.items() if isinstance(err, Exception)
-    }
-    if failed:
-        failed_reqs = [str(e) for e in failed.items()]
-        log.error("bulkInsert API failures: {}".format("; ".join(failed_reqs)))
-        for ident, exc in failed.items():
-            down_nodes(grouped_nodes[ident].nodes, f"GCP Error: {exc._get_reason()}")
-
-    if log.isEnabledFor(logging.DEBUG):
-        for group, op in started.items():
-            group_nodes = grouped_nodelists[group]
-            name = op["name"]
-            gid = op["operationGroupId"]
-            log.debug(
-                f"new bulkInsert operation started: group={group} nodes={group_nodes} name={name} operationGroupId={gid}"
-            )
-    # wait for all bulkInserts to complete and log any errors
-    bulk_operations = {group: wait_for_operation(op) for group, op in started.items()}
-
-    # Start TPU after regular nodes so that regular nodes are not affected by the slower TPU nodes
-    log.debug(f"tpu_start_data={yaml.safe_dump(tpu_start_data)}")
-    execute_with_futures(start_tpu, tpu_start_data)
-
-    all_successful_inserts = []
-
-    for group, bulk_op in bulk_operations.items():
-        group_id = bulk_op["operationGroupId"]
-        bulk_op_name = bulk_op["name"]
-        if "error" in bulk_op:
-            error = bulk_op["error"]["errors"][0]
-            group_nodes = to_hostlist(grouped_nodes[group].nodes)
-            log.warning(
-                f"bulkInsert operation errors: {error['code']} name={bulk_op_name} operationGroupId={group_id} nodes={group_nodes}"
+    bulk_op = wait_for_operation(op)
+    if "error" in bulk_op:
+        error = bulk_op["error"]["errors"][0]
+        group_nodes = to_hostlist(chunk.nodes)
+        log.warning(
+            f"bulkInsert operation errors: {error['code']} name={bulk_op['name']} operationGroupId={group_id} nodes={group_nodes}"
+        )
+    successful_inserts, failed_inserts = separate(
+        lambda op: "error" in op, get_insert_operations(group_id)
+    )
+    if "error" in bulk_op and not successful_inserts and not failed_inserts:
+        return bulk_group_failed(group, chunk, bulk_op, attempt)
+    # Apparently multiple errors are possible... so join with +.
+    by_error_inserts = util.groupby_unsorted(
+        failed_inserts,
+        lambda op: "+".join(err["code"] for err in op["error"]["errors"]),
+    )
+    stockouts = {}
+    for code, failed_ops in by_error_inserts:
+        failed_nodes = {trim_self_link(op["targetLink"]): op for op in failed_ops}
+        if code in STOCKOUT_CODES:
+            stockouts.update(
+                (node, trim_self_link(op["zone"])) for node, op in failed_nodes.items()
             )
-        successful_inserts, failed_inserts = separate(
-            lambda op: "error" in op, get_insert_operations(group_id)
+        hostlist = util.to_hostlist(failed_nodes)
+        count = len(failed_nodes)
+        log.error(
+            f"{count} instances failed to start: {code} ({hostlist}) operationGroupId={group_id}"
         )
-        # Apparently multiple errors are possible... so join with +.
-        by_error_inserts = util.groupby_unsorted(
-            failed_inserts,
-            lambda op: "+".join(err["code"] for err in op["error"]["errors"]),
+        failed_node, failed_op = next(iter(failed_nodes.items()))
+        msg = "; ".join(
+            f"{err['code']}: {err['message'] if 'message' in err else 'no message'}"
+            for err in failed_op["error"]["errors"]
         )
-        for code, failed_ops in by_error_inserts:
-            failed_nodes = {trim_self_link(op["targetLink"]): op for op in failed_ops}
-            hostlist = util.to_hostlist(failed_nodes)
-            count = len(failed_nodes)
-            log.error(
-                f"{count} instances failed to start: {code} ({hostlist}) operationGroupId={group_id}"
-            )
-            failed_node, failed_op = next(iter(failed_nodes.items()))
-            msg = "; ".join(
-                f"{err['code']}: {err['message'] if 'message' in err else 'no message'}"
-                for err in failed_op["error"]["errors"]
-            )
-            if code != "RESOURCE_ALREADY_EXISTS":
-                down_nodes(hostlist, f"GCP Error: {msg}")
-            log.error(
-                f"errors from insert for node '{failed_node}' ({failed_op['name']}): {msg}"
+        if code in STOCKOUT_CODES and retry_stockouts(chunk, attempt):
+            continue
+        if code != "RESOURCE_ALREADY_EXISTS":
+            down_nodes(hostlist, f"GCP Error: {msg}")
+        log.error(
+            f"errors from insert for node '{failed_node}' ({failed_op['name']}): {msg}"
+        )
+
+    ready_nodes = {trim_self_link(op["targetLink"]) for op in successful_inserts}
+    start_boot_timing(
+        submitted, {trim_self_link(op["targetLink"]): op for op in successful_inserts}
+    )
+    if len(ready_nodes) > 0:
+        ready_nodelist = to_hostlist(ready_nodes)
+        log.info(f"created {len(ready_nodes)} instances: nodes={ready_nodelist}")
+    if stockouts:
+        zone_nodes = collections.Counter(stockouts.values())
+        for zone, count in zone_nodes.items():
+            metrics.inc("slurm_gcp_zone_stockout_nodes_total", count, zone=zone)
+        lkp.record_zone_stockouts(zone_nodes)
+    if stockouts and retry_stockouts(chunk, attempt):
+        ready_nodes |= retry_bulk_group(group, chunk, sorted(stockouts), attempt)
+    return ready_nodes
+
+
+def bulk_group_failed(group, chunk, bulk_op, attempt):
+    """handle a bulkInsert operation that failed before inserting any
+    instance, eg. a zone without capacity for minCount of them. Stockouts are
+    recorded and retried like the ones of single inserts, other nodes downed.
+    returns the nodes that were created by a retry
+    """
+    errors = bulk_op["error"]["errors"]
+    msg = "; ".join(
+        f"{err['code']}: {err.get('message', 'no message')}" for err in errors
+    )
+    log.error(f"{len(chunk.nodes)} instances failed to start: {msg}")
+    zones = set()
+    if any(err["code"] in STOCKOUT_CODES for err in errors):
+        zones.update(
+            m["zone"]
+            for err in errors
+            for m in ZONE_LINK_REGEX.finditer(err.get("message", ""))
+        )
+        if "zone" in bulk_op:
+            zones.add(trim_self_link(bulk_op["zone"]))
+    if zones:
+        for zone in zones:
+            metrics.inc(
+                "slurm_gcp_zone_stockout_nodes_total", len(chunk.nodes), zone=zone
             )
+        lkp.record_zone_stockouts(dict.fromkeys(zones, len(chunk.nodes)))
+        if retry_stockouts(chunk, attempt):
+            return retry_bulk_group(group, chunk, chunk.nodes, attempt)
+    down_nodes(chunk.nodes, f"GCP Error: {msg}")
+    return set()
+
 
-        ready_nodes = {trim_self_link(op["targetLink"]) for op in successful_inserts}
-        if len(ready_nodes) > 0:
-            ready_nodelist = to_hostlist(ready_nodes)
-            log.info(f"created {len(ready_nodes)} instances: nodes={ready_nodelist}")
-            all_successful_inserts.extend(successful_inserts)
+def retry_stockouts(chunk, attempt):
+    """whether to retry the stockouts of a node group in other zones"""
+    if not cfg.zone_stockout_ttl or chunk.placement_group is not None:
+        return False
+    nodeset = lkp.node_nodeset(chunk.nodes[0])
+    return attempt + 1 < len(lkp.nodeset_allowed_zones(nodeset))
+
+
+def retry_bulk_group(group, chunk, nodes, attempt):
+    """bulkInsert nodes of a group again, avoiding the zones out of capacity
+    The nodes are downed if every allowed zone is out of capacity.
+    """
+    nodeset = lkp.node_nodeset(nodes[0])
+    avoid = stockout_zones(nodeset)
+    if not avoid:
+        log.error(
+            f"all zones of nodeset {nodeset.nodeset_name} are out of capacity ({to_hostlist(nodes)})"
+        )
+        down_nodes(nodes, "GCP Error: zones out of capacity")
+        return set()
+    log.info(
+        f"retrying {len(nodes)} instances outside of zones {','.join(sorted(avoid))}: {to_hostlist(nodes)}"
+    )
+    insert = create_instances_request(
+        nodes, chunk.partition_name, chunk.placement_group, chunk.job_id
+    )
+    retry = chunk._replace(nodes=nodes)
+    return resume_bulk_group(f"{group}:retry{attempt + 1}", retry, insert, attempt + 1)
 
 
 def update_job_comment(nodelist: list, comment: str):
@@ -492,23 +741,25 @@ def update_job_comment(nodelist: list, comment: str):
         for job in resume_data.jobs
         if any(map(lambda each: each in nodelist, to_hostnames(job.nodelist_resume)))
     )
-    for job in job_list:
-        run(f"{lkp.scontrol} update jobid={job.job_id} admincomment='{comment}'")
-        run(f"{lkp.scontrol} notify {job.job_id} '{comment}'")
+    job_ids = [job.job_id for job in job_list]
+    slurm_updates.update_jobs(job_ids, admincomment=comment)
+    slurm_updates.notify_jobs(job_ids, comment)
 
 
 def down_nodes(nodelist, reason):
-    """set nodes down with reason"""
-    if isinstance(nodelist, list):
-        nodelist = util.to_hostlist(nodelist)
+    """set nodes down with reason, applied with the other updates collected
+    when resume_nodes() finishes
+    """
+    if isinstance(nodelist, str):
+        nodelist = util.to_hostnames(nodelist)
     update_job_comment(nodelist, reason)
-    run(f"{lkp.scontrol} update nodename={nodelist} state=down reason='{reason}'")
+    slurm_updates.update_nodes(nodelist, state="down", reason=reason)
 
 
 def hold_job(job_id, reason):
     """hold job, set comment to reason"""
-    run(f"{lkp.scontrol} hold jobid={job_id}")
-    run(f"{lkp.scontrol} update jobid={job_id} comment='{reason}'")
+    slurm_updates.hold_jobs([job_id])
+    slurm_updates.update_jobs([job_id], comment=reason)
 
 
 def create_placement_request(pg_name, region):
@@ -531,74 +782,82 @@ def create_placement_request(pg_name, region):
 
 
 def create_placement_groups(node_list: list, job_id=0):
-    pgs = {}
-    node_map = lkp.nodeset_map(node_list)
-    for _, nodes in node_map.items():
-        pgs.update(create_nodeset_placement_groups(nodes, job_id=job_id))
-    return pgs
+    groups, to_create = plan_placement_groups(node_list, job_id=job_id)
+    insert_placement_groups(to_create)
+    return groups
+
+
+def plan_placement_groups(node_list: list, job_id=0):
+    """assign nodes to placement groups without creating them
+    returns the nodes of each group, None for nodes without one, and the
+    regions of the groups that need to be created
+    """
+    groups, to_create = {}, {}
+    for nodes in lkp.nodeset_map(node_list).values():
+        pgs, pg_regions = plan_nodeset_placement_groups(nodes, job_id=job_id)
+        for pg, pg_nodes in pgs.items():
+            groups.setdefault(pg, []).extend(pg_nodes)
+        to_create.update(pg_regions)
+    return groups, to_create
 
 
-def create_nodeset_placement_groups(node_list: list, job_id=0):
+def plan_nodeset_placement_groups(node_list: list, job_id=0):
     model = next(iter(node_list))
     nodeset = lkp.node_nodeset(model)
     if not nodeset.enable_placement:
-        return {None: node_list}
+        return {None: node_list}, {}
     if not valid_placement_nodes(job_id, node_list):
-        return {None: node_list}
+        return {None: node_list}, {}
     region = lkp.node_region(model)
 
-    groups = {
-        f"{cfg.slurm_cluster_name}-{nodeset.nodeset_name}-{job_id}-{i}": nodes
-        for i, nodes in enumerate(chunked(node_list, n=PLACEMENT_MAX_CNT))
-    }
+    chunks = list(chunked(node_list, n=PLACEMENT_MAX_CNT))
+    # jobs take free policies from the pool first, the rest get their own
+    pooled = (
+        lkp.claim_placement_policies(region, len(chunks), job_id, nodeset.nodeset_name)
+        if job_id
+        else []
+    )
+    names = chain(
+        pooled,
+        (
+            f"{cfg.slurm_cluster_name}-{nodeset.nodeset_name}-{job_id}-{i}"
+            for i in range(len(pooled), len(chunks))
+        ),
+    )
+    groups = dict(zip(names, chunks))
+    if pooled:
+        log.info(f"claimed pooled placement groups for job {job_id}: {pooled}")
+    to_create = {group: region for group in groups if group not in pooled}
+    return groups, to_create
 
-    if log.isEnabledFor(logging.DEBUG):
-        debug_groups = {group: to_hostlist(nodes) for group, nodes in groups.items()}
-        log.debug(
-            f"creating {len(groups)} placement groups: \n{yaml.safe_dump(debug_groups).rstrip()}"
-        )
+
+def insert_placement_groups(to_create):
+    """create placement groups, given as name: region, in one batch"""
+    if not to_create:
+        return
+    log.debug(
+        "creating %d placement groups: %s", len(to_create), Lazy(list, to_create)
+    )
     requests = {
         group: create_placement_request(group, region)
-        for group, incl_nodes in groups.items()
+        for group, region in to_create.items()
     }
-    ops = dict(
-        zip(requests.keys(), map_with_futures(ensure_execute, requests.values()))
-    )
+    done, errors = util.batch_execute_wait(requests)
 
-    def classify_result(item):
-        op = item[1]
-        if not isinstance(op, Exception):
-            return "submitted"
-        if all(e.get("reason") == "alreadyExists" for e in op.error_details):
-            return "redundant"
-        return "failed"
-
-    grouped_ops = dict(util.groupby_unsorted(list(ops.items()), classify_result))
-    submitted, redundant, failed = (
-        dict(grouped_ops.get(key, {})) for key in ("submitted", "redundant", "failed")
-    )
-    if redundant:
-        log.warning(
-            "placement policies already exist: {}".format(",".join(redundant.keys()))
+    def already_exists(err):
+        details = getattr(err, "error_details", None)
+        return isinstance(details, list) and all(
+            e.get("reason") == "alreadyExists" for e in details
         )
+
+    redundant, failed = separate(lambda group: already_exists(errors[group]), errors)
+    if redundant:
+        log.warning("placement policies already exist: {}".format(",".join(redundant)))
     if failed:
-        reqs = [f"{e}" for _, e in failed.values()]
+        reqs = [f"{group}: {errors[group]}" for group in failed]
         log.fatal("failed to create placement policies: {}".format("; ".join(reqs)))
-    operations = {group: wait_for_operation(op) for group, op in submitted.items()}
-    for group, op in operations.items():
-        if "error" in op:
-            msg = "; ".join(
-                f"{err['code']}: {err['message'] if 'message' in err else 'no message'}"
-                for err in op["error"]["errors"]
-            )
-            log.error(
-                f"placement group failed to create: '{group}' ({op['name']}): {msg}"
-            )
-
-    log.info(
-        f"created {len(operations)} placement groups ({to_hostlist(operations.keys())})"
-    )
-    return groups
+    if done:
+        log.info(f"created {len(done)} placement groups ({to_hostlist(done.keys())})")
 
 
 def valid_placement_nodes(job_id, nodelist):
@@ -620,15 +879,17 @@ def valid_placement_nodes(job_id, nodelist):
     return True
 
 
-def get_resume_file_data():
-    SLURM_RESUME_FILE = os.getenv("SLURM_RESUME_FILE")
-    if SLURM_RESUME_FILE is None:
-        log.warning(
-            "SLURM_RESUME_FILE was not in environment. Cannot get detailed job, node, partition allocation data."
-        )
-        return None
-    resume_file = Path(SLURM_RESUME_FILE)
-    resume_json = resume_file.read_text()
+def get_resume_file_data(resume_json=None):
+    """resume data from SLURM_RESUME_FILE, or its contents if given"""
+    if resume_json is None:
+        SLURM_RESUME_FILE = os.getenv("SLURM_RESUME_FILE")
+        if SLURM_RESUME_FILE is None:
+            log.warning(
+                "SLURM_RESUME_FILE was not in environment. Cannot get detailed job, node, partition allocation data."
+            )
+            return None
+        resume_file = Path(SLURM_RESUME_FILE)
+        resume_json = resume_file.read_text()
     if args.loglevel == logging.DEBUG:
         (dirs.scripts / "resume_data.json").write_text(resume_json)
     return NSDict(json.loads(resume_json))
@@ -643,7 +904,9 @@ def main(nodelist, force=False):
     cloud_nodes, local_nodes = lkp.filter_nodes(nodes)
     if len(local_nodes) > 0:
         log.debug(
-            f"Ignoring slurm-gcp external nodes '{util.to_hostlist(local_nodes)}' from '{nodelist}'"
+            "Ignoring slurm-gcp external nodes '%s' from '%s'",
+            Lazy(util.to_hostlist, local_nodes),
+            nodelist,
         )
     cloud_nodelist = util.to_hostlist(cloud_nodes)
     if len(cloud_nodes) > 0:
@@ -653,6 +916,7 @@ def main(nodelist, force=False):
         return
 
     log.info(f"resume {cloud_nodelist}")
+    metrics.inc("slurm_gcp_resume_nodes_total", len(cloud_nodes))
     resume_nodes(cloud_nodes, global_resume_data)
     # TODO only run below if resume_nodes succeeds but
     # resume_nodes does not currently return any status.
@@ -690,8 +954,10 @@ parser.add_argument(
 )
 
 
-if __name__ == "__main__":
-    args = parser.parse_args()
+def run_cli(argv=None, resume_json=None):
+    """run as ResumeProgram, argv and resume_json are given by worker.py"""
+    global args, global_resume_data
+    args = parser.parse_args(argv)
 
     if cfg.enable_debug_logging:
         args.loglevel = logging.DEBUG
@@ -702,5 +968,9 @@ if __name__ == "__main__":
     util.config_root_logger(filename, level=args.loglevel, logfile=LOGFILE)
     sys.excepthook = util.handle_exception
 
-    global_resume_data = get_resume_file_data()
+    global_resume_data = get_resume_file_data(resume_json)
     main(args.nodelist, args.force)
+
+
+if __name__ == "__main__":
+    run_cli()
@@ -15,6 +15,8 @@
 # limitations under the License.
 
 import argparse
+import hashlib
+import json
 import logging
 import os
 import re
@@ -24,7 +26,12 @@ import sys
 import stat
 import time
 import socket
-from concurrent.futures import as_completed
+from concurrent.futures import (
+    FIRST_COMPLETED,
+    ThreadPoolExecutor,
+    as_completed,
+    wait as wait_futures,
+)
 from functools import partialmethod, lru_cache
 from itertools import chain
 from pathlib import Path
@@ -59,6 +66,11 @@ log = logging.getLogger(filename)
 
 Path.mkdirp = partialmethod(Path.mkdir, parents=True, exist_ok=True)
 
+# setup steps baked into an image by --bake, with the digests of their inputs
+BAKED_FILE = dirs.slurm / "baked.json"
+# digests of the inputs of the setup steps applied by this process
+applied_steps = {}
+
 
 MOTD_HEADER = """
                                  SSSSSSS
@@ -130,13 +142,39 @@ Log back in to ensure your home directory is correct.
 
 
 def failed_motd():
-    """modify motd to signal that setup is failed"""
+    """modify motd to signal that setup is failed, and publish the failure
+    for slurmsync to power the node down without waiting for ResumeTimeout
+    """
+    util.set_boot_phase("failed")
     wall_msg = f"*** Slurm setup failed! Please view log: {LOGFILE} ***"
     motd_msg = MOTD_HEADER + wall_msg + "\n\n"
     Path("/etc/motd").write_text(motd_msg)
     util.run(f"wall -n '{wall_msg}'", timeout=30)
 
 
+def content_hash(*parts):
+    """digest of the inputs of a setup step"""
+    data = json.dumps(parts, sort_keys=True, default=str)
+    return hashlib.sha256(data.encode()).hexdigest()
+
+
+@lru_cache(maxsize=None)
+def baked_steps():
+    """digests of the inputs of the setup steps baked into the image"""
+    try:
+        return json.loads(BAKED_FILE.read_text())["steps"]
+    except (FileNotFoundError, ValueError, KeyError):
+        return {}
+
+
+def baked(step, digest):
+    """whether step was baked into the image with the same inputs"""
+    if baked_steps().get(step) != digest:
+        return False
+    log.info(f"{step} is unchanged since the image was baked, skipping")
+    return True
+
+
 def install_custom_scripts(clean=False):
     """download custom scripts from gcs bucket"""
 
@@ -158,6 +196,9 @@ def install_custom_scripts(clean=False):
     )
     prefixes = [f"slurm-{tok}-script" for tok in prefix_tokens]
     blobs = list(chain.from_iterable(blob_list(prefix=p) for p in prefixes))
+    digest = content_hash(sorted((blob.name, blob.md5_hash) for blob in blobs))
+    if not clean and baked("install_scripts", digest):
+        return
 
     if clean:
         path = Path(dirs.custom_scripts)
@@ -185,6 +226,7 @@ def install_custom_scripts(clean=False):
         with fullpath.open("wb") as f:
             blob.download_to_file(f)
         util.chown_slurm(fullpath, mode=0o755)
+    applied_steps["install_scripts"] = digest
 
 
 def run_custom_scripts():
@@ -253,7 +295,7 @@ def local_mounts(mountlist):
 def resolve_network_storage(partition_name=None):
     """Combine appropriate network_storage fields to a single list"""
 
-    if lkp.instance_role == "compute":
+    if partition_name is None and lkp.instance_role == "compute":
         try:
             partition_name = lkp.node_partition_name()
         except Exception:
@@ -310,15 +352,21 @@ def partition_mounts(mounts):
 
 
 def setup_network_storage():
+    """mount network storage and get the munge key"""
+    mount_network_storage()
+    munge_mount_handler()
+
+
+def mount_network_storage(mount=True):
     """prepare network fs mounts and add them to fstab"""
     log.info("Set up network storage")
-    # filter mounts into two dicts, cluster-internal and external mounts
 
     all_mounts = resolve_network_storage()
-    ext_mounts, int_mounts = partition_mounts(all_mounts)
-    mounts = ext_mounts
-    if lkp.instance_role != "controller":
-        mounts.extend(int_mounts)
+    if lkp.instance_role == "controller":
+        # the controller does not mount the cluster-internal mounts it exports
+        mounts, _ = partition_mounts(all_mounts)
+    else:
+        mounts = list(all_mounts)
 
     # Determine fstab entries and write them out
     fstab_entries = []
@@ -359,18 +407,21 @@ def setup_network_storage():
                 )
             )
 
-    fstab = Path("/etc/fstab")
-    if not Path(fstab.with_suffix(".bak")).is_file():
-        shutil.copy2(fstab, fstab.with_suffix(".bak"))
-    shutil.copy2(fstab.with_suffix(".bak"), fstab)
-    with open(fstab, "a") as f:
-        f.write("\n")
-        for entry in fstab_entries:
-            f.write(entry)
+    digest = content_hash(fstab_entries)
+    if not baked("network_storage", digest):
+        fstab = Path("/etc/fstab")
+        if not Path(fstab.with_suffix(".bak")).is_file():
+            shutil.copy2(fstab, fstab.with_suffix(".bak"))
+        shutil.copy2(fstab.with_suffix(".bak"), fstab)
+        with open(fstab, "a") as f:
             f.write("\n")
+            for entry in fstab_entries:
+                f.write(entry)
+                f.write("\n")
+        applied_steps["network_storage"] = digest
 
-    mount_fstab(local_mounts(mounts))
-    munge_mount_handler()
+    if mount:
+        mount_fstab(local_mounts(mounts))
 
 
 def mount_fstab(mounts):
@@ -551,18 +602,31 @@ def setup_jwt_key():
 
 def setup_slurmd_cronjob():
     """Create cronjob for keeping slurmd service up"""
-    run(
-        "crontab -u root -",
-        input=(
-            "*/2 * * * * "
-            "if [ `systemctl status slurmd | grep -c inactive` -gt 0 ]; then "
-            "mount -a; "
-            "systemctl restart munge; "
-            "systemctl restart slurmd; "
-            "fi\n"
-        ),
-        timeout=30,
+    crontab = (
+        "*/2 * * * * "
+        "if [ `systemctl status slurmd | grep -c inactive` -gt 0 ]; then "
+        "mount -a; "
+        "systemctl restart munge; "
+        "systemctl restart slurmd; "
+        "fi\n"
     )
+    digest = content_hash(crontab)
+    if baked("slurmd_cronjob", digest):
+        return
+    run("crontab -u root -", input=crontab, timeout=30)
+    applied_steps["slurmd_cronjob"] = digest
+
+
+def setup_slurmsync():
+    """run slurmsync.py on the controller from either slurmcmd.timer or the
+    slurmsync.service daemon, never both
+    """
+    if lkp.cfg.slurmsync_daemon:
+        run("systemctl disable --now slurmcmd.timer", timeout=30, check=False)
+        run("systemctl enable --now slurmsync.service", timeout=30)
+    else:
+        run("systemctl disable --now slurmsync.service", timeout=30, check=False)
+        run("systemctl enable --now slurmcmd.timer", timeout=30)
 
 
 def setup_munge_key():
@@ -580,6 +644,9 @@ def setup_munge_key():
 
 def setup_nss_slurm():
     """install and configure nss_slurm"""
+    digest = content_hash(str(slurmdirs.prefix))
+    if baked("nss_slurm", digest):
+        return
     # setup nss_slurm
     Path("/var/spool/slurmd").mkdirp()
     run(
@@ -589,6 +656,7 @@ def setup_nss_slurm():
         check=False,
     )
     run(r"sed -i 's/\(^\(passwd\|group\):\s\+\)/\1slurm /g' /etc/nsswitch.conf")
+    applied_steps["nss_slurm"] = digest
 
 
 def setup_sudoers():
@@ -597,9 +665,13 @@ def setup_sudoers():
 slurm ALL= NOPASSWD: /usr/bin/systemctl restart slurmd.service
 slurm ALL= NOPASSWD: /usr/bin/systemctl restart slurmctld.service
 """
+    digest = content_hash(content)
+    if baked("sudoers", digest):
+        return
     sudoers_file = Path("/etc/sudoers.d/slurm")
     sudoers_file.write_text(content)
     sudoers_file.chmod(0o0440)
+    applied_steps["sudoers"] = digest
 
 
 def update_system_config(file, content):
@@ -680,6 +752,50 @@ def configure_dirs():
     scripts_log.symlink_to(dirs.log)
 
 
+def run_setup_steps(steps):
+    """Run setup steps concurrently, each as soon as the steps it comes after
+    are done. steps is a dict of name: (function, names of prior steps).
+    Logs the time each step took, and raises the first failure.
+    returns the time each step finished at
+    """
+    pending = dict(steps)
+    done = set()
+    running = {}
+    timings = {}
+    finished_at = {}
+
+    def timed_step(name, func):
+        start = time.monotonic()
+        log.info(f"setup step {name} started")
+        try:
+            func()
+        except Exception:
+            log.error(f"setup step {name} failed after {time.monotonic() - start:.1f}s")
+            raise
+        timings[name] = time.monotonic() - start
+        finished_at[name] = time.time()
+        log.info(f"setup step {name} done in {timings[name]:.1f}s")
+
+    with ThreadPoolExecutor() as exe:
+        while pending or running:
+            ready = [name for name, (_, after) in pending.items() if done >= set(after)]
+            for name in ready:
+                func, _ = pending.pop(name)
+                running[exe.submit(timed_step, name, func)] = name
+            if not running:
+                raise Exception(f"setup steps never ready: {', '.join(pending)}")
+            finished, _ = wait_futures(running, return_when=FIRST_COMPLETED)
+            for future in finished:
+                name = running.pop(future)
+                future.result()
+                done.add(name)
+    log.info(
+        "setup step timings: "
+        + ", ".join(f"{name}={secs:.1f}s" for name, secs in timings.items())
+    )
+    return finished_at
+
+
 def setup_controller(args):
     """Run controller setup"""
     log.info("Setting up controller")
@@ -736,7 +852,7 @@ def setup_controller(args):
     run("systemctl start nfs-server", timeout=30)
 
     setup_nfs_exports()
-    run("systemctl enable --now slurmcmd.timer", timeout=30)
+    setup_slurmsync()
 
     log.info("Check status of cluster services")
     run("systemctl status munge", timeout=30)
@@ -789,6 +905,7 @@ def setup_login(args):
 def setup_compute(args):
     """run compute node setup"""
     log.info("Setting up compute")
+    util.set_boot_phase("setup")
     util.chown_slurm(dirs.scripts / "config.yaml", mode=0o600)
     slurmctld_host = f"{lkp.control_host}"
     if lkp.control_addr:
@@ -801,24 +918,43 @@ def setup_compute(args):
         slurmd_options.append(f'--conf="Feature={args.slurmd_feature}"')
         slurmd_options.append("-Z")
     sysconf = f"""SLURMD_OPTIONS='{" ".join(slurmd_options)}'"""
-    update_system_config("slurmd", sysconf)
-    install_custom_scripts()
 
-    setup_nss_slurm()
-    setup_network_storage()
+    def check_gpu():
+        has_gpu = run(
+            "lspci | grep --ignore-case 'NVIDIA' | wc -l", shell=True
+        ).returncode
+        if has_gpu:
+            run("nvidia-smi")
 
-    has_gpu = run("lspci | grep --ignore-case 'NVIDIA' | wc -l", shell=True).returncode
-    if has_gpu:
-        run("nvidia-smi")
+    def start_munge():
+        run("systemctl restart munge", timeout=30)
 
-    run_custom_scripts()
+    def start_slurmd():
+        run("systemctl enable slurmd", timeout=30)
+        run("systemctl restart slurmd", timeout=30)
+        run("systemctl enable --now slurmcmd.timer", timeout=30)
 
-    setup_slurmd_cronjob()
-    setup_sudoers()
-    run("systemctl restart munge", timeout=30)
-    run("systemctl enable slurmd", timeout=30)
-    run("systemctl restart slurmd", timeout=30)
-    run("systemctl enable --now slurmcmd.timer", timeout=30)
+    # custom scripts still run before slurmd, with storage mounted
+    finished_at = run_setup_steps(
+        {
+            "slurmd_config": (lambda: update_system_config("slurmd", sysconf), ()),
+            "install_scripts": (install_custom_scripts, ()),
+            "nss_slurm": (setup_nss_slurm, ()),
+            "network_storage": (mount_network_storage, ()),
+            "munge_key": (munge_mount_handler, ()),
+            "gpu": (check_gpu, ()),
+            "slurmd_cronjob": (setup_slurmd_cronjob, ()),
+            "sudoers": (setup_sudoers, ()),
+            "custom_scripts": (
+                run_custom_scripts,
+                ("install_scripts", "nss_slurm", "network_storage", "gpu"),
+            ),
+            "munge": (start_munge, ("munge_key",)),
+            "slurmd": (start_slurmd, ("slurmd_config", "munge", "custom_scripts")),
+        }
+    )
+    for step, when in finished_at.items():
+        util.set_boot_phase(step, when)
 
     log.info("Check status of cluster services")
     run("systemctl status munge", timeout=30)
@@ -827,7 +963,53 @@ def setup_compute(args):
     log.info("Done setting up compute")
 
 
+def devel_zip_md5():
+    """base64 md5 of the devel zip in the cluster bucket, as gsutil shows it,
+    None if there is none
+    """
+    try:
+        blob = util.blob_get("slurm-gcp-devel.zip")
+        blob.reload()
+    except Exception as e:
+        log.info(f"no devel zip to bake: {e}")
+        return None
+    return blob.md5_hash
+
+
+def bake_compute(nodeset_name):
+    """apply the compute setup that does not depend on the instance, to bake
+    an image for the nodes of a nodeset. setup_compute() on the image skips the
+    steps whose inputs are unchanged since.
+    """
+    if nodeset_name not in cfg.nodeset:
+        raise Exception(f"nodeset {nodeset_name} is not in config.yaml")
+    log.info(f"Baking compute setup for nodeset {nodeset_name}")
+    install_custom_scripts()
+    setup_nss_slurm()
+    # mounts are only reachable from the cluster, fstab is mounted at boot
+    mount_network_storage(mount=False)
+    setup_slurmd_cronjob()
+    setup_sudoers()
+    BAKED_FILE.write_text(
+        json.dumps(
+            {
+                "nodeset": nodeset_name,
+                "time": time.time(),
+                # startup.sh fetches the devel zip again once it changes
+                "devel_zip_md5": devel_zip_md5(),
+                "steps": applied_steps,
+            },
+            indent=2,
+        )
+    )
+    log.info(f"Baked setup steps: {', '.join(applied_steps)}")
+
+
 def main(args):
+    if args.bake:
+        bake_compute(args.bake)
+        return
+
     start_motd()
     configure_dirs()
 
@@ -857,6 +1039,11 @@ if __name__ == "__main__":
         dest="slurmd_feature",
         help="Feature for slurmd to register with. Controller ignores this option.",
     )
+    parser.add_argument(
+        "--bake",
+        metavar="NODESET",
+        help="Bake the compute setup that is not instance specific into an image.",
+    )
     args = parser.parse_args()
 
     util.config_root_logger(filename, logfile=LOGFILE)
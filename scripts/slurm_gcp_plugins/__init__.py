@@ -2,40 +2,84 @@ import importlib
 import pkgutil
 import logging
 import inspect
+import threading
+from functools import lru_cache
+from time import monotonic
 
-# Only perform discovery at init
-discovered_plugins = {
-    name.lstrip("."): importlib.import_module(name=name, package="slurm_gcp_plugins")
-    for finder, name, ispkg in pkgutil.iter_modules(path=__path__, prefix=".")
-    if name.lstrip(".") != "utils"
-}
+import metrics
 
+# Only perform discovery at init, plugins are imported once enabled
+discovered_plugins = sorted(
+    name
+    for finder, name, ispkg in pkgutil.iter_modules(path=__path__)
+    if name != "utils"
+)
 logging.info(
-    (
-        "slurm_gcp_plugins found:"
-        + ", ".join(
-            [
-                "slurm_gcp_plugins" + plugin
-                for plugin in sorted(discovered_plugins.keys())
-            ]
-        )
-    )
+    "slurm_gcp_plugins found:"
+    + ", ".join("slurm_gcp_plugins." + plugin for plugin in discovered_plugins)
 )
 
+# imported plugin modules by name, None if the import failed
+loaded_plugins = {}
+load_lock = threading.Lock()
+
+
+def load_plugin(plugin):
+    """import a plugin the first time it is needed"""
+    with load_lock:
+        if plugin not in loaded_plugins:
+            try:
+                loaded_plugins[plugin] = importlib.import_module(
+                    name=f".{plugin}", package="slurm_gcp_plugins"
+                )
+            except Exception as e:
+                logging.error(f"Plugin {plugin} failed to import: {e}")
+                loaded_plugins[plugin] = None
+        return loaded_plugins[plugin]
+
 
 def get_plugins():
-    return discovered_plugins
+    plugins = {plugin: load_plugin(plugin) for plugin in discovered_plugins}
+    return {plugin: module for plugin, module in plugins.items() if module}
+
+
+def enabled_plugins(enable_slurm_gcp_plugins):
+    """names of the discovered plugins enabled in config, all of them if it is
+    just true
+    """
+    if not enable_slurm_gcp_plugins:
+        return ()
+    if isinstance(enable_slurm_gcp_plugins, bool):
+        return tuple(discovered_plugins)
+    return tuple(p for p in discovered_plugins if p in enable_slurm_gcp_plugins)
+
+
+@lru_cache(maxsize=None)
+def hook_table(function_name, plugins):
+    """(plugin, function) of the given plugins that implement the hook"""
+    table = []
+    for plugin in plugins:
+        module = load_plugin(plugin)
+        function = getattr(module, function_name, None) if module else None
+        if inspect.isfunction(function):
+            table.append((plugin, function))
+    logging.debug(
+        f"Plugin callback {function_name} dispatches to: "
+        + ", ".join(plugin for plugin, _ in table)
+    )
+    return tuple(table)
 
 
 def get_plugins_function(function_name):
-    plugins = get_plugins()
+    return dict(hook_table(function_name, tuple(discovered_plugins)))
+
 
-    return {
-        plugin: function
-        for plugin in sorted(plugins.keys())
-        for name, function in inspect.getmembers(plugins[plugin], inspect.isfunction)
-        if name == function_name
-    }
+def record_hook_time(plugin, function_name, seconds):
+    """log and count the time a plugin callback took"""
+    logging.debug(f"Plugin callback {plugin}:{function_name} took {seconds:.3f}s")
+    metrics.observe(
+        "slurm_gcp_plugin_hook_seconds", seconds, plugin=plugin, hook=function_name
+    )
 
 
 def run_plugins_for_function(plugin_function_name, pos_args, keyword_args):
@@ -61,20 +105,17 @@ def run_plugins_for_function(plugin_function_name, pos_args, keyword_args):
         return
 
     cfg = keyword_args["lkp"].cfg
-    if cfg.enable_slurm_gcp_plugins:
-        for plugin, function in get_plugins_function(plugin_function_name).items():
-            if plugin in cfg.enable_slurm_gcp_plugins:
-                logging.debug(f"Running {function} from plugin {plugin}")
-                try:
-                    function(*pos_args, **keyword_args)
-                except BaseException as e:
-                    logging.error(
-                        f"Plugin callback {plugin}:{function} caused an exception: {e}"
-                    )
-            else:
-                logging.debug(
-                    f"Not running {function} from non-enabled plugin {plugin}"
-                )
+    plugins = enabled_plugins(cfg.enable_slurm_gcp_plugins)
+    for plugin, function in hook_table(plugin_function_name, plugins):
+        logging.debug(f"Running {function} from plugin {plugin}")
+        start = monotonic()
+        try:
+            function(*pos_args, **keyword_args)
+        except BaseException as e:
+            logging.error(
+                f"Plugin callback {plugin}:{function} caused an exception: {e}"
+            )
+        record_hook_time(plugin, plugin_function_name, monotonic() - start)
 
 
 # Implement this function to add fields to the cached VM instance lookup
@@ -18,14 +18,20 @@ import slurm_gcp_plugins.utils as sgp_utils
 # If no max_hops is provided but the plugins is still enabled the default level is 3
 
 
+# beta compute service, built once per process
+beta_compute = None
+
+
 def pre_placement_group_insert(*pos_args, **keyword_args):
+    global beta_compute
     logging.info("Trying to enable max hop")
     # Avoid circular import (util imports the plugins)
     if "util" in sys.modules:
-        logging.info("Setting compute service version to beta")
-        sys.modules["util"].compute = sys.modules["util"].compute_service(
-            version="beta"
-        )
+        util = sys.modules["util"]
+        if beta_compute is None:
+            logging.info("Setting compute service version to beta")
+            beta_compute = util.compute_service(version="beta")
+        util.compute = beta_compute
         max_distance = sgp_utils.get_plugin_setting(
             plugin="max_hops",
             setting="max_hops",
@@ -54,5 +60,9 @@ __all__ = [
 # This should be replaced if the job id becomes available in the context of this plugin hook
 def get_job_from_placement_group_name(pg_name):
     # f"{cfg.slurm_cluster_name}-{partition_name}-{job_id}-{i}"
+    # pooled placement groups, f"{cfg.slurm_cluster_name}-pool-{i}", have no job
 
-    return pg_name.split("-")[2]
+    parts = pg_name.split("-")
+    if parts[1] == "pool":
+        return None
+    return parts[2]
@@ -19,18 +19,22 @@ import fcntl
 import hashlib
 import json
 import logging
+import random
 import re
+import subprocess
 import sys
+from collections import defaultdict
 from enum import Enum
+from functools import lru_cache
 from itertools import chain
 from pathlib import Path
-import yaml
+from time import monotonic, sleep, time
 
+import metrics
 import util
 from util import (
     batch_execute,
     ensure_execute,
-    execute_with_futures,
     fetch_config_yaml,
     fetch_config_yaml_md5,
     load_config_file,
@@ -39,16 +43,19 @@ from util import (
     separate,
     to_hostlist,
     to_hostnames,
-    with_static,
+    Lazy,
     Lookup,
     NSDict,
     TPU,
     chunked,
 )
 from util import lkp, cfg, compute, CONFIG_FILE
-from suspend import delete_instances
-from resume import start_tpu
+from suspend import delete_instances, expire_warm_pool
+from resume import create_placement_request, start_tpus
 from conf import (
+    conf_action,
+    read_confs,
+    ConfAction,
     gen_cloud_conf,
     gen_cloud_gres_conf,
     gen_topology_conf,
@@ -61,10 +68,32 @@ from conf import (
 
 filename = Path(__file__).name
 LOGFILE = (Path(cfg.slurm_log_dir if cfg else ".") / filename).with_suffix(".log")
+BOOT_TIMING_LOG = Path(cfg.slurm_log_dir if cfg else ".") / "boot_timing.jsonl"
+# records of nodes that never came up are dropped after this many seconds
+BOOT_TIMING_MAX_AGE = 7200
+# seconds between checks of a booting node for a setup failure
+BOOT_POLL_INTERVAL = 30
+# seconds after resume before a node is checked, no setup fails sooner
+BOOT_POLL_MIN_AGE = 120
+# booting nodes checked per pass, oldest first
+BOOT_POLL_LIMIT = 100
+# milestone: (phase it starts at, phase it ends at)
+BOOT_MILESTONES = {
+    "api": ("resume", "created"),
+    "provision": ("created", "startup"),
+    "startup": ("startup", "setup"),
+    "setup": ("setup", "slurmd"),
+    "register": ("slurmd", "ready"),
+    "total": ("resume", "ready"),
+}
 
 log = logging.getLogger(filename)
 
 TOT_REQ_CNT = 1000
+# when booting nodes were last checked for a setup failure, by node
+boot_polls = {}
+# instance fields reconciliation needs, besides name, zone, status and role
+SYNC_INSTANCE_FIELDS = ("lastStartTimestamp", "scheduling")
 
 
 NodeStatus = Enum(
@@ -107,34 +136,47 @@ def start_instances(node_list):
         tpuobj = TPU(lkp.cfg.nodeset_tpu[ns])
         for snodes in chunked(nodes, n=tpuobj.vmcount):
             tpu_start_data.append({"tpu": tpuobj, "node": snodes})
-    execute_with_futures(start_tpu, tpu_start_data)
+    start_tpus(tpu_start_data)
 
 
-def _find_tpu_node_status(nodename, state):
-    ns = lkp.node_nodeset(nodename)
-    tpuobj = TPU(ns)
-    inst = tpuobj.get_node(nodename)
+class TpuNodesetState:
+    """the TPU nodes of a nodeset, listed once per pass, and the slice of
+    every slurm node of the nodeset
+    """
+
+    def __init__(self, nodeset):
+        self.tpuobj = TPU(nodeset)
+        self.tpus = {
+            node.name.split("/")[-1]: node for node in self.tpuobj.list_nodes() or ()
+        }
+        # the slices of multi-vm TPUs, as in the topology from conf.py
+        self.slices = {}
+        for nodelist in filter(None, lkp.nodeset_lists(nodeset)):
+            for nodes in chunked(to_hostnames(nodelist), n=self.tpuobj.vmcount):
+                self.slices.update(dict.fromkeys(nodes, nodes))
+
+
+def _find_tpu_node_status(nodename, state, sync):
+    ns_name = lkp.node_nodeset_name(nodename)
+    tpu_nodesets = sync.tpu_nodesets
+    if ns_name not in tpu_nodesets:
+        tpu_nodesets[ns_name] = TpuNodesetState(lkp.node_nodeset(nodename))
+    ns_state = tpu_nodesets[ns_name]
+    tpuobj = ns_state.tpuobj
+    inst = ns_state.tpus.get(nodename)
     # If we do not find the node but it is from a Tpu that has multiple vms look for the master node
     if inst is None and tpuobj.vmcount > 1:
-        # Get the tpu slurm nodelist of the nodes in the same tpu group as nodename
-        nodelist = run(
-            f"{lkp.scontrol} show topo {nodename}"
-            + " | awk -F'=' '/Level=0/ { print $NF }'",
-            shell=True,
-        ).stdout
-        l_nodelist = to_hostnames(nodelist)
-        group_names = set(l_nodelist)
-        # get the list of all the existing tpus in the nodeset
-        tpus_list = set(tpuobj.list_node_names())
-        # In the intersection there must be only one node that is the master
-        tpus_int = list(group_names.intersection(tpus_list))
+        # the tpu slurm nodelist of the nodes in the same tpu group as nodename
+        l_nodelist = ns_state.slices.get(nodename, [nodename])
+        # In the existing tpus there must be only one node that is the master
+        tpus_int = [node for node in l_nodelist if node in ns_state.tpus]
         if len(tpus_int) > 1:
             log.error(
-                f"More than one cloud tpu node for tpu group {nodelist}, there should be only one that should be {l_nodelist[0]}, but we have found {tpus_int}"
+                f"More than one cloud tpu node for tpu group {to_hostlist(l_nodelist)}, there should be only one that should be {l_nodelist[0]}, but we have found {tpus_int}"
             )
             return NodeStatus.unknown
         if len(tpus_int) == 1:
-            inst = tpuobj.get_node(tpus_int[0])
+            inst = ns_state.tpus[tpus_int[0]]
         # if len(tpus_int ==0) this case is not relevant as this would be the case always that a TPU group is not running
     if inst is None:
         if state.base == "DOWN" and "POWERED_DOWN" in state.flags:
@@ -148,7 +190,7 @@ def _find_tpu_node_status(nodename, state):
             & state.flags
         ):
             return NodeStatus.unbacked
-        if nodename in find_node_status.static_nodeset:
+        if nodename in sync.static_nodeset:
             return NodeStatus.resume
     elif (
         state is not None
@@ -171,69 +213,148 @@ def _find_tpu_node_status(nodename, state):
     return NodeStatus.unchanged
 
 
-def allow_power_down(state):
-    config = run(f"{lkp.scontrol} show config").stdout.rstrip()
-    m = re.search(r"SuspendExcStates\s+=\s+(?P<states>[\w\(\)]+)", config)
-    if not m:
-        log.warning("SuspendExcStates not found in Slurm config")
+# slurm node state as a bitmask, of the base state DOWN and the flags below
+DOWN, COMPLETING, POWER_DOWN, POWERING_UP, POWERING_DOWN, POWERED_DOWN = (
+    1 << i for i in range(6)
+)
+STATE_BITS = {
+    "COMPLETING": COMPLETING,
+    "POWER_DOWN": POWER_DOWN,
+    "POWERING_UP": POWERING_UP,
+    "POWERING_DOWN": POWERING_DOWN,
+    "POWERED_DOWN": POWERED_DOWN,
+}
+POWER_BITS = POWER_DOWN | POWERING_UP | POWERING_DOWN | POWERED_DOWN
+# instance status as bits, POOLABLE for util.WARM_POOL_STATUSES
+RUNNING, STOPPED, POOLABLE = (1 << i for i in range(3))
+STATUS_BITS = {
+    "RUNNING": RUNNING,
+    "STOPPING": POOLABLE,
+    "SUSPENDING": POOLABLE,
+    "TERMINATED": STOPPED | POOLABLE,
+    "SUSPENDED": STOPPED | POOLABLE,
+}
+
+
+@lru_cache(maxsize=None)
+def state_mask(state):
+    """bitmask of a NodeState, the few distinct states are converted once"""
+    mask = DOWN if state.base == "DOWN" else 0
+    for flag in state.flags:
+        mask |= STATE_BITS.get(flag, 0)
+    return mask
+
+
+class SyncPass:
+    """what node classification needs besides the node and its instance,
+    computed once per reconciliation
+    """
+
+    def __init__(self):
+        self.static_nodeset = set(to_hostnames(lkp.static_nodelist()))
+        self.warm_pool = lkp.warm_pool()
+        self.warm_pool_nodesets = {
+            name for name in cfg.nodeset if lkp.nodeset_warm_pool(name)
+        }
+        self.tpu_nodesets = {}
+        # SuspendExcStates, fetched when a node first needs it
+        self._suspend_exc_states = ()
+
+    def suspend_exc_states(self):
+        """SuspendExcStates of the slurm config, None if it is not there"""
+        if self._suspend_exc_states == ():
+            config = run(f"{lkp.scontrol} show config").stdout.rstrip()
+            m = re.search(r"SuspendExcStates\s+=\s+(?P<states>[\w\(\)]+)", config)
+            if not m:
+                log.warning("SuspendExcStates not found in Slurm config")
+            self._suspend_exc_states = (
+                frozenset(m.group("states").upper().split(",")) if m else None
+            )
+        return self._suspend_exc_states
+
+    def allow_power_down(self, state):
+        states = self.suspend_exc_states()
+        if states is None:
+            return True
+        if "(NULL)" in states or not states.isdisjoint(state.flags | {state.base}):
+            return False
         return True
-    states = set(m.group("states").split(","))
-    if "(null)" in states or bool(state & state.flags.union(state.base)):
-        return False
-    return True
-
 
-@with_static(static_nodeset=None)
-def find_node_status(nodename):
-    """Determine node/instance status that requires action"""
-    if find_node_status.static_nodeset is None:
-        find_node_status.static_nodeset = set(util.to_hostnames(lkp.static_nodelist()))
-    state = lkp.slurm_node(nodename)
-    if lkp.node_is_tpu(nodename):
-        return _find_tpu_node_status(nodename, state)
-    inst = lkp.instance(nodename)
-    power_flags = state.flags & frozenset(
-        ("POWER_DOWN", "POWERING_UP", "POWERING_DOWN", "POWERED_DOWN")
-    )
-    if inst is None:
-        if "POWERING_UP" in state.flags:
+    def classify(self, nodes, slurm_nodes, instances):
+        """nodes grouped by the NodeStatus that requires action, in one pass
+        over the slurm state and instance of each node
+        """
+        statuses = defaultdict(list)
+        node_desc = lkp.node_nodeset_name
+        tpu_nodesets = cfg.nodeset_tpu
+        for nodename in nodes:
+            state = slurm_nodes.get(nodename)
+            nodeset_name = node_desc(nodename)
+            if nodeset_name in tpu_nodesets:
+                status = _find_tpu_node_status(nodename, state, self)
+            else:
+                inst = instances.get(nodename)
+                status = self.node_status(nodename, nodeset_name, state, inst)
+            statuses[status].append(nodename)
+        return dict(statuses)
+
+    def node_status(self, nodename, nodeset_name, state, inst):
+        """Determine node/instance status that requires action"""
+        mask = state_mask(state) if state is not None else 0
+        power_bits = mask & POWER_BITS
+        if inst is None:
+            if mask & POWERING_UP:
+                return NodeStatus.unchanged
+            if mask & DOWN and mask & POWERED_DOWN:
+                return NodeStatus.restore
+            if mask & POWERING_DOWN:
+                return NodeStatus.restore
+            if mask & COMPLETING:
+                return NodeStatus.unbacked
+            if not mask & DOWN and not power_bits:
+                return NodeStatus.unbacked
+            if mask & DOWN and not power_bits and self.allow_power_down(state):
+                return NodeStatus.power_down
+            if mask & POWERED_DOWN and nodename in self.static_nodeset:
+                return NodeStatus.resume
             return NodeStatus.unchanged
-        if state.base == "DOWN" and "POWERED_DOWN" in state.flags:
-            return NodeStatus.restore
-        if "POWERING_DOWN" in state.flags:
-            return NodeStatus.restore
-        if "COMPLETING" in state.flags:
-            return NodeStatus.unbacked
-        if state.base != "DOWN" and not power_flags:
-            return NodeStatus.unbacked
-        if state.base == "DOWN" and not power_flags and allow_power_down(state):
-            return NodeStatus.power_down
+
+        status = STATUS_BITS.get(inst.status, 0)
+        if state is None:
+            # the instance exists but it's not in Slurm
+            return NodeStatus.orphan if status & RUNNING else NodeStatus.unknown
         if (
-            "POWERED_DOWN" in state.flags
-            and nodename in find_node_status.static_nodeset
+            power_bits & (POWERING_DOWN | POWERED_DOWN)
+            and nodeset_name in self.warm_pool_nodesets
+            and (nodename in self.warm_pool or status & POOLABLE)
         ):
-            return NodeStatus.resume
-    elif (
-        state is not None
-        and "POWERED_DOWN" not in state.flags
-        and "POWERING_DOWN" not in state.flags
-        and inst.status == "TERMINATED"
-    ):
-        if inst.scheduling.preemptible:
-            return NodeStatus.preempted
-        if not state.base.startswith("DOWN"):
-            return NodeStatus.terminated
-    elif (state is None or "POWERED_DOWN" in state.flags) and inst.status == "RUNNING":
-        return NodeStatus.orphan
-    elif state is None:
-        # if state is None here, the instance exists but it's not in Slurm
-        return NodeStatus.unknown
-
-    return NodeStatus.unchanged
-
-
-def do_node_update(status, nodes):
-    """update node/instance based on node status"""
+            # being stopped or suspended into the warm pool of its nodeset, or
+            # left stopped outside of it
+            if nodename in self.warm_pool:
+                return NodeStatus.unchanged
+            if mask & POWERED_DOWN:
+                return NodeStatus.orphan
+        elif (
+            mask & POWERING_UP
+            and nodeset_name in self.warm_pool_nodesets
+            and status & POOLABLE
+        ):
+            # a pooled instance that resume has yet to start or resume
+            return NodeStatus.unchanged
+        elif not power_bits & (POWERING_DOWN | POWERED_DOWN) and status & STOPPED:
+            if inst.scheduling.preemptible:
+                return NodeStatus.preempted
+            if not mask & DOWN:
+                return NodeStatus.terminated
+        elif mask & POWERED_DOWN and status & RUNNING:
+            return NodeStatus.orphan
+        return NodeStatus.unchanged
+
+
+def do_node_update(status, nodes, updates):
+    """update node/instance based on node status, slurm node updates are
+    added to updates for the caller to apply
+    """
     if status == NodeStatus.unchanged:
         return
     count = len(nodes)
@@ -244,24 +365,24 @@ def do_node_update(status, nodes):
         log.info(
             f"{count} nodes set down due to node status '{status.name}' ({hostlist})"
         )
-        run(
-            f"{lkp.scontrol} update nodename={hostlist} state=down reason='Instance stopped/deleted'"
-        )
+        updates.update_nodes(nodes, state="down", reason="Instance stopped/deleted")
 
     def nodes_restart():
         """start instances for nodes"""
         log.info(f"{count} instances restarted ({hostlist})")
+        # the nodes must be down before their instances come back
+        updates.apply()
         start_instances(nodes)
 
     def nodes_idle():
         """idle nodes"""
         log.info(f"{count} nodes to idle ({hostlist})")
-        run(f"{lkp.scontrol} update nodename={hostlist} state=resume")
+        updates.update_nodes(nodes, state="resume")
 
     def nodes_resume():
         """resume nodes via scontrol"""
         log.info(f"{count} instances to resume ({hostlist})")
-        run(f"{lkp.scontrol} update nodename={hostlist} state=power_up")
+        updates.update_nodes(nodes, state="power_up")
 
     def nodes_delete():
         """delete instances for nodes"""
@@ -271,14 +392,13 @@ def do_node_update(status, nodes):
     def nodes_power_down():
         """power_down node in slurm"""
         log.info(f"{count} instances to power down ({hostlist})")
-        run(f"{lkp.scontrol} update nodename={hostlist} state=power_down")
+        updates.update_nodes(nodes, state="power_down")
 
     def nodes_unknown():
         """Error status, nodes shouldn't get in this status"""
         log.error(f"{count} nodes have unexpected status: ({hostlist})")
         first = next(iter(nodes))
-        state = lkp.slurm_node(first)
-        state = "{}+{}".format(state.base, "+".join(state.flags))
+        state = str(lkp.slurm_node(first))
         inst = lkp.instance(first)
         log.error(f"{first} state: {state}, instance status:{inst.status}")
 
@@ -317,7 +437,9 @@ def delete_placement_groups(placement_groups):
 
 
 def sync_placement_groups():
-    """Delete placement policies that are for jobs that have completed/terminated"""
+    """Delete placement policies that are for jobs that have completed/terminated
+    and keep the pool of placement policies at placement_pool_size per region
+    """
     keep_states = frozenset(
         [
             "RUNNING",
@@ -331,75 +453,440 @@ def sync_placement_groups():
     if lkp.instance_role_safe != "controller":
         return
 
-    keep_jobs = {
-        str(job["job_id"])
-        for job in json.loads(run(f"{lkp.scontrol} show jobs --json").stdout)["jobs"]
-        if job["job_state"] in keep_states
-    }
-
     fields = "items.regions.resourcePolicies,nextPageToken"
     flt = f"name={lkp.cfg.slurm_cluster_name}-*"
     act = compute.resourcePolicies()
     op = act.aggregatedList(project=lkp.project, fields=fields, filter=flt)
     placement_groups = {}
+    pool_groups = {}
     pg_regex = re.compile(
         rf"{lkp.cfg.slurm_cluster_name}-(?P<partition>[^\s\-]+)-(?P<job_id>\d+)-(?P<index>\d+)"
     )
+    pool_regex = re.compile(rf"{lkp.cfg.slurm_cluster_name}-pool-(?P<index>\d+)$")
     while op is not None:
         result = ensure_execute(op)
-        # merge placement group info from API and job_id,partition,index parsed from the name
-        pgs = (
-            NSDict({**pg, **pg_regex.match(pg["name"]).groupdict()})
-            for pg in chain.from_iterable(
-                item["resourcePolicies"]
-                for item in result.get("items", {}).values()
-                if item
-            )
-            if pg_regex.match(pg["name"]) is not None
-        )
-        placement_groups.update(
-            {pg["name"]: pg for pg in pgs if pg.get("job_id") not in keep_jobs}
-        )
+        for pg in chain.from_iterable(
+            item["resourcePolicies"]
+            for item in result.get("items", {}).values()
+            if item
+        ):
+            # merge info from the API and job_id,partition,index parsed from the name
+            if pool_regex.match(pg["name"]) is not None:
+                pg = NSDict({**pg, **pool_regex.match(pg["name"]).groupdict()})
+                pool_groups[(util.trim_self_link(pg.region), pg.name)] = pg
+            elif pg_regex.match(pg["name"]) is not None:
+                pg = NSDict({**pg, **pg_regex.match(pg["name"]).groupdict()})
+                placement_groups[pg.name] = pg
         op = act.aggregatedList_next(op, result)
 
+    pool = lkp.placement_pool()
+    keep_jobs = set()
+    if placement_groups or any(pool.values()):
+        keep_jobs = {
+            str(job["job_id"])
+            for job in json.loads(run(f"{lkp.scontrol} show jobs --json").stdout)[
+                "jobs"
+            ]
+            if job["job_state"] in keep_states
+        }
+    placement_groups = {
+        name: pg for name, pg in placement_groups.items() if pg.job_id not in keep_jobs
+    }
     if len(placement_groups) > 0:
         delete_placement_groups(list(placement_groups.values()))
 
+    sync_placement_pool(pool_groups, keep_jobs)
 
-def sync_slurm():
-    if lkp.instance_role_safe != "controller":
+
+def placement_policy_users():
+    """(region, name) of the placement policies listed instances are in"""
+    instances = lkp.instances(fields=("resourcePolicies",))
+    return {
+        (util.parse_self_link(link).region, util.trim_self_link(link))
+        for inst in instances.values()
+        for link in inst.get("resourcePolicies") or ()
+    }
+
+
+def sync_placement_pool(pool_groups, keep_jobs):
+    """create missing pooled placement policies, release the claims of jobs
+    that are finished and forget policies that are gone
+    Claims are released once no instance is left in the policy, the instances
+    of a finished job stay in it until they are deleted.
+    """
+    size = lkp.cfg.placement_pool_size or 0
+    regions = {
+        util.parse_self_link(nodeset.subnetwork).region
+        for nodeset in lkp.cfg.nodeset.values()
+        if nodeset.enable_placement
+    }
+    wanted = {
+        (region, lkp.placement_pool_name(i)) for region in regions for i in range(size)
+    }
+
+    # the same names are used in every region
+    requests = {
+        f"{region}/{name}": create_placement_request(name, region)
+        for region, name in wanted
+        if (region, name) not in pool_groups
+    }
+    created = set()
+    if requests:
+        done, errors = util.batch_execute_wait(requests)
+        if errors:
+            failed = [f"{rid}: {err}" for rid, err in errors.items()]
+            log.error(f"some pooled placement groups failed to create: {failed}")
+        log.info(f"created {len(done)} pooled placement groups")
+        created = {tuple(rid.split("/", 1)) for rid in done}
+
+    pool = lkp.placement_pool()
+    busy = set()
+    if any(
+        key not in pool or (pool[key] is not None and pool[key] not in keep_jobs)
+        for key in pool_groups
+    ):
+        busy = placement_policy_users()
+
+    surplus = {}
+    with lkp.cache.lock():
+        pool = lkp.placement_pool()
+        for key in created:
+            lkp.set_placement_pool(*key, None)
+        for key, pg in pool_groups.items():
+            claim = pool.get(key)
+            if claim is not None and claim in keep_jobs:
+                continue
+            if key not in wanted:
+                surplus[key] = pg
+            elif key in busy:
+                # instances of its last job are still in it
+                log.debug(f"pooled placement group {pg.name} of job {claim} draining")
+            elif key not in pool or claim is not None:
+                # released, or a pooled policy this host has no record of yet
+                log.debug(f"releasing pooled placement group {pg.name} of job {claim}")
+                lkp.set_placement_pool(*key, None)
+        gone = [
+            lkp.placement_pool_key(*key)
+            for key in pool
+            if key not in pool_groups and key not in created
+        ]
+        gone.extend(lkp.placement_pool_key(*key) for key in surplus)
+        lkp.cache.remove(gone)
+
+    for _, pgs in util.groupby_unsorted(list(surplus.items()), lambda kv: kv[0][0]):
+        delete_placement_groups([pg for _, pg in pgs])
+
+
+def get_boot_phases_request(node):
+    return compute.instances().getGuestAttributes(
+        project=lkp.project,
+        zone=lkp.instance(node).zone,
+        instance=node,
+        queryPath=f"{util.BOOT_PHASE_NAMESPACE}/",
+    )
+
+
+def percentile(values, pct):
+    """nearest rank percentile of sorted values"""
+    return values[max(0, -(-len(values) * pct // 100) - 1)]
+
+
+def fail_failed_boots(booting, updates):
+    """down and power down booting nodes that published a setup failure,
+    rather than waiting out ResumeTimeout. Slurm requeues their jobs on other
+    nodes, and the nodes are restored once powered down.
+    booting is a list of (node, boot timing record). The oldest
+    BOOT_POLL_LIMIT are checked, paced by their own rate limiter.
+    """
+    booting = sorted(booting, key=lambda nr: nr[1]["phases"]["resume"])
+    booting = booting[:BOOT_POLL_LIMIT]
+    if not booting:
+        return
+    boot_polls.update(dict.fromkeys((node for node, _ in booting), time()))
+    requests = {node: get_boot_phases_request(node) for node, _ in booting}
+    done, failed = batch_execute(requests, limiter=util.rate_limiter("boot_poll"))
+    for node, (_, err) in failed.items():
+        log.debug(f"no boot phases for {node}: {err}")
+    failures = []
+    for node, record in booting:
+        items = done.get(node, {}).get("queryValue", {}).get("items", [])
+        for item in items:
+            # attributes left over from an earlier boot of a pooled instance
+            if item["key"] == "failed" and (
+                float(item["value"]) >= record["phases"]["resume"]
+            ):
+                failures.append(node)
+    if not failures:
         return
 
+    log.warning(
+        f"{len(failures)} nodes failed setup, powering them down: {to_hostlist(failures)}"
+    )
+    for nodeset, nodes in util.groupby_unsorted(failures, lkp.node_nodeset_name):
+        metrics.inc("slurm_gcp_boot_failures_total", len(list(nodes)), nodeset=nodeset)
+    updates.update_nodes(failures, state="down", reason="slurm-gcp setup failed")
+    updates.update_nodes(failures, state="power_down_force")
+    lkp.boot_timing.remove(failures)
+
+
+def collect_boot_timing(updates):
+    """collect the boot phases of nodes that became ready since they were
+    resumed, append them to boot_timing.jsonl and log percentiles per nodeset.
+    Nodes still booting are checked for a setup failure.
+    """
+    now = time()
+    ready = []
+    booting = []
+    stale = []
+    for node in lkp.boot_timing.keys():
+        record = lkp.boot_timing.get(node)
+        if record is None:
+            continue
+        state = lkp.slurm_node(node)
+        if now - record["phases"]["resume"] > BOOT_TIMING_MAX_AGE:
+            stale.append(node)
+        elif state is None:
+            stale.append(node)
+        elif lkp.instance(node) is None:
+            continue
+        elif "POWERING_UP" in state.flags:
+            booting.append((node, record))
+        elif "POWERED_DOWN" not in state.flags and state.base != "DOWN":
+            ready.append((node, record))
+    lkp.boot_timing.remove(stale)
+    # only the nodes still booting are polled again
+    polls = {node: boot_polls.get(node, 0) for node, _ in booting}
+    boot_polls.clear()
+    boot_polls.update(polls)
+    fail_failed_boots(
+        [
+            (n, r)
+            for n, r in booting
+            if now - polls[n] >= BOOT_POLL_INTERVAL
+            and now - r["phases"]["resume"] >= BOOT_POLL_MIN_AGE
+        ],
+        updates,
+    )
+    if not ready:
+        return
+
+    requests = {node: get_boot_phases_request(node) for node, _ in ready}
+    done, failed = batch_execute(requests)
+    for node, (_, err) in failed.items():
+        log.debug(f"no boot phases for {node}: {err}")
+    records = []
+    for node, record in ready:
+        phases = record["phases"]
+        items = done.get(node, {}).get("queryValue", {}).get("items", [])
+        for item in items:
+            when = float(item["value"])
+            # attributes left over from an earlier boot of a pooled instance
+            if when >= phases["resume"]:
+                phases.setdefault(item["key"], when)
+        phases["ready"] = now
+        record["node"] = node
+        record["durations"] = {
+            milestone: round(phases[end] - phases[start], 3)
+            for milestone, (start, end) in BOOT_MILESTONES.items()
+            if start in phases and end in phases
+        }
+        records.append(record)
+
+    with open(BOOT_TIMING_LOG, "a") as f:
+        for record in records:
+            f.write(json.dumps(record) + "\n")
+    util.chown_slurm(BOOT_TIMING_LOG)
+    lkp.boot_timing.remove(node for node, _ in ready)
+
+    for nodeset, ns_records in util.groupby_unsorted(records, lambda r: r["nodeset"]):
+        ns_records = list(ns_records)
+        summary = []
+        for milestone in BOOT_MILESTONES:
+            values = sorted(
+                r["durations"][milestone]
+                for r in ns_records
+                if milestone in r["durations"]
+            )
+            if values:
+                summary.append(
+                    f"{milestone} p50={percentile(values, 50):.1f}s "
+                    f"p90={percentile(values, 90):.1f}s "
+                    f"p99={percentile(values, 99):.1f}s"
+                )
+        log.info(
+            f"boot timing of {len(ns_records)} nodes in {nodeset}: {', '.join(summary)}"
+        )
+
+
+def sync_slurm(nodes=None):
+    """reconcile slurm nodes and instances, limited to nodes if given
+    returns the nodes grouped by NodeStatus
+    """
+    if lkp.instance_role_safe != "controller":
+        return {}
+    start = monotonic()
+
+    # a full pass lists every zone, to reconcile instances left in zones the
+    # nodesets no longer use
+    instances = lkp.instances(
+        fields=SYNC_INSTANCE_FIELDS, zones=() if nodes is None else None
+    )
     compute_instances = [
-        name for name, inst in lkp.instances().items() if inst.role == "compute"
+        name for name, inst in instances.items() if inst.role == "compute"
     ]
+    slurm_states = lkp.slurm_nodes()
     slurm_nodes = list(
         name
-        for name, state in lkp.slurm_nodes().items()
+        for name, state in slurm_states.items()
         if "DYNAMIC_NORM" not in state.flags
     )
-    all_nodes = list(
-        set(
-            chain(
-                compute_instances,
-                slurm_nodes,
-            )
+    all_nodes = set(
+        chain(
+            compute_instances,
+            slurm_nodes,
         )
     )
+    all_nodes_synced = nodes is None
+    if nodes is not None:
+        all_nodes.intersection_update(nodes)
+    all_nodes = list(all_nodes)
     log.debug(
         f"reconciling {len(compute_instances)} ({len(all_nodes)-len(compute_instances)}) GCP instances and {len(slurm_nodes)} Slurm nodes ({len(all_nodes)-len(slurm_nodes)})."
     )
-    node_statuses = {
-        k: list(v) for k, v in util.groupby_unsorted(all_nodes, find_node_status)
+    node_statuses = SyncPass().classify(all_nodes, slurm_states, instances)
+    log.debug(
+        "node statuses: \n%s",
+        Lazy(
+            util.hostlists_yaml,
+            {status.name: nodes for status, nodes in node_statuses.items()},
+        ),
+    )
+
+    updates = util.SlurmUpdates()
+    for status, status_nodes in node_statuses.items():
+        metrics.inc("slurm_gcp_sync_nodes_total", len(status_nodes), status=status.name)
+        with metrics.timer("slurm_gcp_sync_update_seconds", status=status.name):
+            do_node_update(status, status_nodes, updates)
+    collect_boot_timing(updates)
+    updates.apply()
+    if all_nodes_synced:
+        expire_warm_pool()
+    scope = "full" if all_nodes_synced else "delta"
+    metrics.observe("slurm_gcp_sync_seconds", monotonic() - start, scope=scope)
+    return node_statuses
+
+
+class SyncState:
+    """Slurm and instance state kept in memory between daemon ticks"""
+
+    def __init__(self, full_resync_interval):
+        self.full_resync_interval = full_resync_interval
+        self.last_full_resync = None
+        # latest lastStartTimestamp seen, in the format the API returns it
+        self.watermark = None
+        self.slurm_nodes = {}
+        # nodes that needed an update last tick, checked again next tick
+        self.pending = set()
+
+    @property
+    def full_resync_due(self):
+        return (
+            self.last_full_resync is None
+            or monotonic() - self.last_full_resync >= self.full_resync_interval
+        )
+
+    def advance_watermark(self, instances):
+        stamps = [
+            inst.lastStartTimestamp
+            for inst in instances.values()
+            if inst.lastStartTimestamp
+        ]
+        self.watermark = max(filter(None, (self.watermark, *stamps)), default=None)
+
+
+def delta_instance_filter(watermark):
+    """filter for instances that may have changed since the watermark"""
+    flt = 'status != "RUNNING"'
+    if watermark:
+        flt = f'({flt}) OR (lastStartTimestamp > "{watermark}")'
+    return flt
+
+
+def refresh_instances(names):
+    """get cached instances again by name, returns (found, missing)"""
+    cached = {name: lkp.instance(name) for name in names}
+    fields = lkp.instance_fields(fields=SYNC_INSTANCE_FIELDS)
+    requests = {
+        name: compute.instances().get(
+            project=lkp.project, zone=inst.zone, instance=name, fields=fields
+        )
+        for name, inst in cached.items()
+        if inst is not None
     }
-    if log.isEnabledFor(logging.DEBUG):
-        status_nodelist = {
-            status.name: to_hostlist(nodes) for status, nodes in node_statuses.items()
+    done, failed = batch_execute(requests)
+    found = {name: lkp.instance_properties(inst) for name, inst in done.items()}
+    missing = [name for name, inst in found.items() if inst is None]
+    missing.extend(
+        name
+        for name, (_, exc) in failed.items()
+        if getattr(exc, "status_code", None) == 404
+    )
+    found = {name: inst for name, inst in found.items() if inst is not None}
+    return found, missing
+
+
+def sync_tick(state):
+    """one daemon pass, only reconciling nodes that changed since the last
+    pass unless a full resync is due. Returns True on a full resync.
+    """
+    if lkp.instance_role_safe != "controller":
+        return False
+
+    full = state.full_resync_due
+    lkp.clear_slurm_nodes()
+    slurm_nodes = lkp.slurm_nodes()
+    if full:
+        lkp.clear_instances()
+        state.advance_watermark(lkp.instances(fields=SYNC_INSTANCE_FIELDS, zones=()))
+        nodes = None
+    else:
+        changed = {
+            name
+            for name, node_state in slurm_nodes.items()
+            if state.slurm_nodes.get(name) != node_state
+        }
+        changed.update(set(state.slurm_nodes).difference(slurm_nodes))
+        delta = lkp.list_instances(
+            flt=delta_instance_filter(state.watermark), fields=SYNC_INSTANCE_FIELDS
+        )
+        # instances that were not RUNNING last tick and are not in the delta
+        # have been deleted, or started before the watermark moved
+        stale = {
+            name
+            for name, inst in lkp.instances().items()
+            if inst.status != "RUNNING" and name not in delta
         }
-        log.debug(f"node statuses: \n{yaml.safe_dump(status_nodelist).rstrip()}")
+        recheck = changed.union(stale, state.pending).difference(delta)
+        found, missing = refresh_instances(recheck)
+        lkp.update_instances({**delta, **found}, removed=missing)
+        state.advance_watermark(delta)
+        nodes = changed.union(delta, found, missing, state.pending)
+        log.debug(
+            f"incremental sync: {len(changed)} slurm node changes, {len(delta)} instance changes, {len(missing)} instances gone"
+        )
 
-    for status, nodes in node_statuses.items():
-        do_node_update(status, nodes)
+    node_statuses = sync_slurm(nodes)
+    state.pending = set(
+        chain.from_iterable(
+            status_nodes
+            for status, status_nodes in node_statuses.items()
+            if status != NodeStatus.unchanged
+        )
+    )
+    state.slurm_nodes = slurm_nodes
+    if full:
+        state.last_full_resync = monotonic()
+    return full
 
 
 def read_hash(filename):
@@ -415,6 +902,120 @@ def save_hash(filename, hash):
         file.write(hash)
 
 
+def fetch_config_hash():
+    """hash of the config.yaml in the bucket. Read from project metadata when
+    terraform publishes it there, so polling does not read the bucket.
+    """
+    try:
+        version, _ = util.fetch_config_version()
+    except Exception as e:
+        log.debug(f"config version not in metadata: {e}")
+        version = None
+    if version is None:
+        return fetch_config_yaml_md5().hexdigest()
+    # same as fetch_config_yaml_md5, which hashes the md5 of the blob
+    return hashlib.md5(version.encode(encoding="utf-8")).hexdigest()
+
+
+def wait_for_config_change(timeout, etag=None):
+    """sleep for timeout seconds, waking up early if the config version in
+    project metadata changes. Returns the etag to wait on next time.
+    """
+    deadline = monotonic() + timeout
+    try:
+        if etag is None:
+            _, etag = util.fetch_config_version()
+        if etag is not None and timeout >= 1:
+            _, new_etag = util.fetch_config_version(etag=etag, timeout=int(timeout))
+            if new_etag != etag:
+                log.debug("config version changed in metadata")
+                return new_etag
+    except Exception as e:
+        log.debug(f"failed to wait for config change: {e}")
+    sleep(max(deadline - monotonic(), 0))
+    return etag
+
+
+def node_config(lkp):
+    """the parts of the config that slurmd on this compute or login node uses
+    directly, slurm.conf itself is pulled from slurmctld
+    """
+    cfg = lkp.cfg
+    view = {
+        "control": (
+            cfg.slurm_control_host,
+            cfg.slurm_control_addr,
+            cfg.slurm_control_host_port,
+        ),
+        "mounts": (cfg.disable_default_mounts, cfg.network_storage, cfg.munge_mount),
+    }
+    if lkp.instance_role_safe == "login":
+        view["login_network_storage"] = cfg.login_network_storage
+        return view
+    try:
+        nodeset_name = lkp.node_nodeset_name()
+    except Exception:
+        # external nodename, only the cluster wide fields apply
+        return view
+    view["nodeset"] = (
+        cfg.nodeset.get(nodeset_name)
+        or cfg.nodeset_tpu.get(nodeset_name)
+        or cfg.nodeset_dyn.get(nodeset_name)
+    )
+    view["partitions"] = {
+        name: part
+        for name, part in cfg.partitions.items()
+        if nodeset_name
+        in chain(
+            part.partition_nodeset,
+            part.partition_nodeset_tpu,
+            part.partition_nodeset_dyn,
+        )
+    }
+    return view
+
+
+def apply_conf_changes(lkp, old_confs):
+    """apply the conf files changed since old_confs with the least disruptive
+    action that covers them, returns False if nothing changed
+    """
+    new_confs = read_confs(lkp)
+    changed = [name for name, conf in new_confs.items() if conf != old_confs[name]]
+    if not changed:
+        log.info("Slurm conf files are unchanged.")
+        return False
+    log.info(f"Slurm conf files changed: {', '.join(changed)}")
+    action, updates = conf_action(old_confs, new_confs)
+    try:
+        if "slurmdbd.conf" in changed:
+            log.info("Restarting slurmdbd to make changes take effect.")
+            run("sudo systemctl restart slurmdbd.service", check=False)
+        if action == ConfAction.RESTART:
+            log.info("Restarting slurmctld to make changes take effect.")
+            run("sudo systemctl restart slurmctld.service", check=False)
+            run(f"{lkp.scontrol} reconfigure", timeout=30)
+        elif action == ConfAction.RECONFIGURE:
+            log.info("Reconfiguring slurmctld to make changes take effect.")
+            run(f"{lkp.scontrol} reconfigure", timeout=30)
+        elif action == ConfAction.UPDATE:
+            failed = False
+            for line in updates:
+                log.info(f"Updating partition: {line}")
+                try:
+                    run(f"{lkp.scontrol} update {line}", timeout=30)
+                except subprocess.SubprocessError as e:
+                    err = (getattr(e, "stderr", None) or str(e)).strip()
+                    log.error(f"partition update failed: {line}: {err}")
+                    failed = True
+            if failed:
+                # slurmctld must not drift from the conf files already written
+                log.info("Reconfiguring slurmctld to apply the partition changes.")
+                run(f"{lkp.scontrol} reconfigure", timeout=30)
+    except Exception as e:
+        log.error(e)
+    return True
+
+
 def reconfigure_slurm():
     CONFIG_HASH = Path("/slurm/scripts/.config.hash")
     update_msg = "*** slurm configuration was updated ***"
@@ -422,20 +1023,28 @@ def reconfigure_slurm():
 
     if cfg_old.hybrid:
         # terraform handles generating the config.yaml, don't do it here
-        return
+        return False
 
-    hash_new: hashlib.md5 = fetch_config_yaml_md5()
+    hash_new: str = fetch_config_hash()
     hash_old: str = read_hash(CONFIG_HASH)
 
-    if hash_new.hexdigest() != hash_old:
+    if hash_new != hash_old:
         log.debug("Delta detected. Reconfiguring Slurm now.")
+        lkp_old = Lookup(cfg_old)
+        window = cfg_old.config_rollout_window or 0
+        if lkp_old.instance_role_safe in ["compute", "login"] and window > 0:
+            # spread bucket reads and slurmd restarts of all nodes over the window
+            delay = random.uniform(0, window)
+            log.info(f"applying configuration change in {delay:.0f}s")
+            sleep(delay)
         cfg_new = fetch_config_yaml()
-        save_hash(CONFIG_HASH, hash_new.hexdigest())
+        save_hash(CONFIG_HASH, hash_new)
         save_config(cfg_new, CONFIG_FILE)
         cfg_new = load_config_file(CONFIG_FILE)
         lkp = Lookup(cfg_new)
         util.lkp = lkp
         if lkp.instance_role_safe == "controller":
+            old_confs = read_confs(lkp)
             install_slurm_conf(lkp)
             install_slurmdbd_conf(lkp)
             gen_cloud_conf(lkp)
@@ -444,19 +1053,19 @@ def reconfigure_slurm():
             install_gres_conf(lkp)
             install_cgroup_conf(lkp)
             install_topology_conf(lkp)
-            log.info("Restarting slurmctld to make changes take effect.")
-            try:
-                run("sudo systemctl restart slurmctld.service", check=False)
-                run(f"{lkp.scontrol} reconfigure", timeout=30)
-            except Exception as e:
-                log.error(e)
-            util.run(f"wall '{update_msg}'", timeout=30)
+            if apply_conf_changes(lkp, old_confs):
+                util.run(f"wall '{update_msg}'", timeout=30)
             log.debug("Done.")
         elif lkp.instance_role_safe in ["compute", "login"]:
+            if node_config(lkp) == node_config(lkp_old):
+                log.info("No changes affect this node, not restarting slurmd.")
+                return True
             log.info("Restarting slurmd to make changes take effect.")
             run("systemctl restart slurmd")
             util.run(f"wall '{update_msg}'", timeout=30)
             log.debug("Done.")
+        return True
+    return False
 
 
 def main():
@@ -475,6 +1084,51 @@ def main():
     except Exception:
         log.exception("failed to sync placement groups")
 
+    try:
+        lkp.validate_template_info_cache()
+    except Exception:
+        log.exception("failed to validate template cache")
+
+
+def daemon(interval, full_resync_interval):
+    """run slurmsync continuously, keeping state in memory between ticks"""
+    log.info(
+        f"slurmsync daemon started: interval={interval}s full_resync_interval={full_resync_interval}s"
+    )
+    state = SyncState(full_resync_interval)
+    config_etag = None
+    while True:
+        start = monotonic()
+        try:
+            if reconfigure_slurm():
+                # exit so the service restarts with the new config loaded
+                log.info("slurm configuration changed, restarting slurmsync daemon")
+                return
+        except Exception:
+            log.exception("failed to reconfigure slurm")
+
+        full = False
+        try:
+            full = sync_tick(state)
+        except Exception:
+            log.exception("failed to sync instances")
+            # state may be inconsistent now, start over with a full resync
+            state.last_full_resync = None
+
+        if full:
+            try:
+                sync_placement_groups()
+            except Exception:
+                log.exception("failed to sync placement groups")
+            try:
+                lkp.validate_template_info_cache()
+            except Exception:
+                log.exception("failed to validate template cache")
+
+        util.flush_metrics()
+        remaining = max(interval - (monotonic() - start), 0)
+        config_etag = wait_for_config_change(remaining, config_etag)
+
 
 parser = argparse.ArgumentParser(
     description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter
@@ -500,6 +1154,23 @@ parser.add_argument(
     action="store_true",
     help="Force tasks to run, regardless of lock.",
 )
+parser.add_argument(
+    "--daemon",
+    action="store_true",
+    help="Run continuously, reconciling only what changed between ticks.",
+)
+parser.add_argument(
+    "--interval",
+    type=int,
+    default=30,
+    help="Seconds between daemon ticks.",
+)
+parser.add_argument(
+    "--full-resync-interval",
+    type=int,
+    default=600,
+    help="Seconds between full resyncs of all instances and nodes in daemon mode.",
+)
 
 if __name__ == "__main__":
     args = parser.parse_args()
@@ -523,4 +1194,8 @@ if __name__ == "__main__":
             if not args.force:
                 sys.exit(0)
 
-    main()
+        # hold the lock for as long as we run
+        if args.daemon:
+            daemon(args.interval, args.full_resync_interval)
+        else:
+            main()
@@ -15,8 +15,11 @@
 
 set -e
 
+BOOT_START="$(date +%s.%N)"
 SLURM_DIR=/slurm
 FLAGFILE=$SLURM_DIR/slurm_configured_do_not_remove
+# written by 'setup.py --bake' in images with compute setup baked in
+BAKED_FILE=$SLURM_DIR/baked.json
 SCRIPTS_DIR=$SLURM_DIR/scripts
 if [[ -z "$HOME" ]]; then
 	# google-startup-scripts.service lacks environment variables
@@ -28,6 +31,12 @@ URL="http://$METADATA_SERVER/computeMetadata/v1"
 HEADER="Metadata-Flavor:Google"
 CURL="curl -sS --fail --header $HEADER"
 
+function boot::phase() {
+	# record when a boot phase was reached, for slurmsync to collect
+	local WHEN="${2:-$(date +%s.%N)}"
+	$CURL -X PUT --data "$WHEN" "$URL/instance/guest-attributes/slurm-boot/$1" >/dev/null 2>&1 || true
+}
+
 function devel::zip() {
 	local BUCKET="$($CURL $URL/instance/attributes/slurm_bucket_path)"
 	if [[ -z $BUCKET ]]; then
@@ -67,27 +76,48 @@ if [ $s -ne 0 ]; then
 else
     echo "INFO: Successfully contacted metadata server"
 fi
-
-GOOGLE_DNS=8.8.8.8
-PING_GOOGLE="ping -q -w1 -c1 $GOOGLE_DNS"
-echo "INFO: $PING_GOOGLE"
-for i in $(seq 5); do
-    [ $i -gt 1 ] && sleep 2;
-    $PING_GOOGLE > /dev/null && s=0 && break || s=$?;
-	echo "failed to ping Google DNS, will retry"
-done
-if [ $s -ne 0 ]; then
-    echo "WARNING: No internet access detected"
-else
-    echo "INFO: Internet access detected"
-fi
+boot::phase startup "$BOOT_START"
+boot::phase metadata
+
+function internet::check() {
+	local GOOGLE_DNS=8.8.8.8
+	local PING_GOOGLE="ping -q -w1 -c1 $GOOGLE_DNS"
+	echo "INFO: $PING_GOOGLE"
+	for i in $(seq 5); do
+		[ $i -gt 1 ] && sleep 2;
+		$PING_GOOGLE > /dev/null && s=0 && break || s=$?;
+		echo "failed to ping Google DNS, will retry"
+	done
+	if [ $s -ne 0 ]; then
+		echo "WARNING: No internet access detected"
+	else
+		echo "INFO: Internet access detected"
+	fi
+}
 
 mkdir -p $SCRIPTS_DIR
 
 SETUP_SCRIPT_FILE=$SCRIPTS_DIR/setup.py
 UTIL_SCRIPT_FILE=$SCRIPTS_DIR/util.py
 
-devel::zip
+function devel::md5() {
+	# base64 md5 of the devel zip in the bucket, empty if there is none
+	local BUCKET="$($CURL $URL/instance/attributes/slurm_bucket_path)"
+	gsutil ls -L "$BUCKET/slurm-gcp-devel.zip" 2>/dev/null | awk '/Hash \(md5\):/ {print $3}'
+}
+
+function baked::devel_md5() {
+	# md5 of the devel zip the image was baked with, empty if none
+	python3 -c 'import json, sys; print(json.load(open(sys.argv[1])).get("devel_zip_md5") or "")' "$BAKED_FILE" 2>/dev/null
+}
+
+if [ -f $BAKED_FILE ] && [ "$(devel::md5)" == "$(baked::devel_md5)" ]; then
+	# the scripts of a baked image are updated by baking it again
+	echo "INFO: Image has baked setup and devel zip, skipping internet check and devel zip"
+else
+	internet::check
+	devel::zip
+fi
 
 if [ -f $FLAGFILE ]; then
 	echo "WARNING: Slurm was previously configured, quitting"
@@ -163,7 +193,8 @@ SLURMD_FEATURE="$(fetch_feature)"
 
 echo "INFO: Running python cluster setup script"
 chmod +x $SETUP_SCRIPT_FILE
-python3 $SCRIPTS_DIR/util.py
+# setup.py cannot report its own failure without the python modules
+python3 $SCRIPTS_DIR/util.py || { boot::phase failed; exit 1; }
 if [[ -n "$SLURMD_FEATURE" ]]; then
 	echo "INFO: Running dynamic node setup."
 	exec $SETUP_SCRIPT_FILE --slurmd-feature="$SLURMD_FEATURE"
@@ -16,29 +16,47 @@
 # limitations under the License.
 
 import argparse
+import fcntl
+import json
 import logging
+import os
 import sys
-from pathlib import Path
+import time
 
-import util
-from util import (
+if __name__ == "__main__":
+    # hand off to the pre-warmed worker before the slow imports, if it is up
+    try:
+        import worker
+    except ImportError:
+        pass
+    else:
+        worker.forward_or_continue("suspend")
+
+from contextlib import contextmanager  # noqa: E402
+from pathlib import Path  # noqa: E402
+
+import metrics  # noqa: E402
+import util  # noqa: E402
+from util import (  # noqa: E402
     groupby_unsorted,
     log_api_request,
-    batch_execute,
+    batch_execute_wait,
     to_hostlist,
-    wait_for_operations,
+    Lazy,
     separate,
-    execute_with_futures,
 )
-from util import lkp, cfg, compute, TPU
+from util import lkp, cfg, compute, TPU, TPUJob  # noqa: E402
 
-import slurm_gcp_plugins
+import slurm_gcp_plugins  # noqa: E402
 
 filename = Path(__file__).name
 LOGFILE = (Path(cfg.slurm_log_dir if cfg else ".") / filename).with_suffix(".log")
 log = logging.getLogger(filename)
 
 TOT_REQ_CNT = 1000
+SPOOL_DIR = Path(__file__).parent / "suspend_spool"
+# seconds a pooled instance may take to stop or suspend
+WARM_POOL_GRACE = 300
 
 
 def truncate_iter(iterable, max_count):
@@ -62,35 +80,43 @@ def delete_instance_request(instance, project=None, zone=None):
     return request
 
 
-def stop_tpu(data):
-    tpu_nodeset = data["nodeset"]
-    node = data["node"]
-    tpu = data["tpu"]
-    if tpu_nodeset.preserve_tpu and tpu.vmcount == 1:
+def stop_tpu_job(tpu, nodeset, node):
+    """TPUJob that stops a preserved single-vm TPU node, or deletes the node"""
+    delete = TPUJob(tpu, "delete", node)
+    if nodeset.preserve_tpu and tpu.vmcount == 1:
         log.info(f"stopping node {node}")
-        if tpu.stop_node(node):
-            return
-        log.error("Error stopping node {node} will delete instead")
+        return TPUJob(tpu, "stop", node, fallback=delete)
     log.info(f"deleting node {node}")
-    if not tpu.delete_node(node):
-        log.error("Error deleting node {node}")
+    return delete
 
 
 def delete_tpu_instances(instances):
-    stop_data = []
+    jobs = []
     for prefix, nodes in util.groupby_unsorted(instances, lkp.node_prefix):
         log.info(f"Deleting TPU nodes from prefix {prefix}")
         lnodes = list(nodes)
         tpu_nodeset = lkp.node_nodeset(lnodes[0])
         tpu = TPU(tpu_nodeset)
-        stop_data.extend(
-            [{"tpu": tpu, "node": node, "nodeset": tpu_nodeset} for node in lnodes]
-        )
-    execute_with_futures(stop_tpu, stop_data)
+        jobs.extend(stop_tpu_job(tpu, tpu_nodeset, node) for node in lnodes)
+    if jobs:
+        util.run_tpu_jobs(jobs)
+
+
+def down_failed_nodes(failed):
+    """set nodes down with the error that kept them from being deleted"""
+    updates = util.SlurmUpdates()
+    for err, nodes in groupby_unsorted(list(failed), lambda n: str(failed[n])):
+        hostlist = to_hostlist(nodes)
+        log.error(f"instances failed to delete: {err} ({hostlist})")
+        reason = err.replace("'", "")[:250]
+        updates.update_nodes(nodes, state="down", reason=f"suspend failed: {reason}")
+    updates.apply()
 
 
 def delete_instances(instances):
     """delete instances individually"""
+    # only the zone is needed to delete
+    lkp.instances(fields=())
     invalid, valid = separate(lambda inst: bool(lkp.instance(inst)), instances)
     if len(invalid) > 0:
         log.debug("instances do not exist: {}".format(",".join(invalid)))
@@ -102,13 +128,187 @@ def delete_instances(instances):
     requests = {inst: delete_instance_request(inst) for inst in valid}
 
     log.info(f"delete {len(valid)} instances ({valid_hostlist})")
-    done, failed = batch_execute(requests)
+    deleted, errors = batch_execute_wait(requests)
+    failed, gone = separate(
+        lambda inst: getattr(errors[inst], "status_code", None) == 404, errors
+    )
+    if gone:
+        # deleted by someone else meanwhile, eg. slurmsync or a preemption
+        log.info(f"instances already deleted ({to_hostlist(gone)})")
     if failed:
-        for err, nodes in groupby_unsorted(lambda n: failed[n][1], failed.keys()):
-            log.error(f"instances failed to delete: {err} ({to_hostlist(nodes)})")
-    wait_for_operations(done.values())
-    # TODO do we need to check each operation for success? That is a lot more API calls
-    log.info(f"deleted {len(done)} instances {to_hostlist(done.keys())}")
+        down_failed_nodes({inst: errors[inst] for inst in failed})
+    if deleted:
+        log.info(f"deleted {len(deleted)} instances {to_hostlist(deleted)}")
+
+
+def pool_instance_request(instance, mode):
+    """stop or suspend the instance of a node going into the warm pool"""
+    if mode == "suspend":
+        method = compute.instances().suspend
+    else:
+        method = compute.instances().stop
+    request = method(
+        project=lkp.project, zone=lkp.instance(instance).zone, instance=instance
+    )
+    log_api_request(request)
+    return request
+
+
+def pool_instances(nodes):
+    """Stop or suspend instances into the warm pool of their nodeset, while the
+    pool has room.
+    returns the nodes that still have to be deleted
+    """
+    pool = lkp.warm_pool()
+    lkp.instances(fields=())
+    pooling = {}
+    rest = []
+    for nodeset_name, ns_nodes in groupby_unsorted(nodes, lkp.node_nodeset_name):
+        warm_pool = lkp.nodeset_warm_pool(nodeset_name)
+        if warm_pool is None:
+            rest.extend(ns_nodes)
+            continue
+        room = warm_pool.size - sum(
+            1 for node in pool if lkp.node_nodeset_name(node) == nodeset_name
+        )
+        for node in ns_nodes:
+            inst = lkp.instance(node)
+            if (
+                room > 0
+                and inst is not None
+                and inst.status == "RUNNING"
+                # exclusive job nodes are labeled for their job
+                and "slurm_job_id" not in inst.labels
+                and not lkp.node_is_static(node)
+            ):
+                pooling[node] = warm_pool.mode
+                room -= 1
+            else:
+                rest.append(node)
+    if not pooling:
+        return rest
+
+    # in the pool before the operation so slurmsync does not see orphans
+    lkp.pool_nodes(pooling)
+    log.info(f"pool {len(pooling)} instances ({to_hostlist(pooling)})")
+    requests = {node: pool_instance_request(node, mode) for node, mode in pooling.items()}
+    pooled, errors = batch_execute_wait(requests)
+    if errors:
+        for err, nodes in groupby_unsorted(list(errors), lambda n: str(errors[n])):
+            log.warning(
+                f"instances failed to pool, deleting instead: {err} ({to_hostlist(nodes)})"
+            )
+        lkp.unpool_nodes(errors)
+        rest.extend(errors)
+    if pooled:
+        log.info(f"pooled {len(pooled)} instances {to_hostlist(pooled)}")
+    return rest
+
+
+def expire_warm_pool():
+    """Delete pooled instances past the ttl or over the size of their pool, and
+    forget pooled nodes whose instance is gone or running again
+    """
+    pool = lkp.warm_pool()
+    if not pool:
+        return
+    now = time.time()
+    expired = []
+    forget = []
+    for nodeset_name, nodes in groupby_unsorted(list(pool), lkp.node_nodeset_name):
+        warm_pool = lkp.nodeset_warm_pool(nodeset_name)
+        kept = 0
+        # newest first, so the oldest are the first over the size
+        for node in sorted(nodes, key=pool.get, reverse=True):
+            inst = lkp.instance(node)
+            if inst is None or (
+                inst.status not in util.WARM_POOL_STATUSES
+                and now - pool[node] > WARM_POOL_GRACE
+            ):
+                forget.append(node)
+            elif (
+                warm_pool is None
+                or kept >= warm_pool.size
+                or now - pool[node] > warm_pool.ttl
+            ):
+                expired.append(node)
+            else:
+                kept += 1
+    if forget:
+        log.debug("forget pooled nodes %s", Lazy(to_hostlist, forget))
+        lkp.unpool_nodes(forget)
+    if expired:
+        log.info(f"expire {len(expired)} pooled instances ({to_hostlist(expired)})")
+        lkp.unpool_nodes(expired)
+        delete_instances(expired)
+
+
+def spool_nodes(nodes):
+    """add nodes to the spool shared by concurrent SuspendProgram calls"""
+    SPOOL_DIR.mkdirp()
+    name = f"{time.time_ns()}-{os.getpid()}"
+    tmp = SPOOL_DIR / f".{name}"
+    tmp.write_text(json.dumps(nodes))
+    tmp.rename(SPOOL_DIR / name)
+
+
+def spooled_files():
+    return [path for path in SPOOL_DIR.iterdir() if not path.name.startswith(".")]
+
+
+def take_spooled_nodes():
+    """remove all spooled nodes, deduplicated, from the spool"""
+    nodes = set()
+    for path in spooled_files():
+        try:
+            nodes.update(json.loads(path.read_text()))
+        except FileNotFoundError:
+            continue
+        except ValueError:
+            log.error(f"dropping unreadable suspend spool file {path}")
+        path.unlink(missing_ok=True)
+    return nodes
+
+
+@contextmanager
+def spool_leader():
+    """yields True if this process holds the spool lock"""
+    with open(SPOOL_DIR / ".leader", "a") as f:
+        try:
+            fcntl.lockf(f, fcntl.LOCK_EX | fcntl.LOCK_NB)
+        except OSError:
+            yield False
+            return
+        try:
+            yield True
+        finally:
+            fcntl.lockf(f, fcntl.LOCK_UN)
+
+
+def coalesce_deletes(nodes, window):
+    """Spool nodes for deletion. The first caller to find no leader becomes the
+    leader, it waits out the window and deletes everything spooled meanwhile, in
+    full batches, until a window passes with nothing new. Other callers return
+    as soon as their nodes are spooled.
+    """
+    spool_nodes(nodes)
+    while True:
+        with spool_leader() as leader:
+            if not leader:
+                log.debug("nodes spooled for deletion (%s)", Lazy(to_hostlist, nodes))
+                return
+            while True:
+                time.sleep(window)
+                spooled = take_spooled_nodes()
+                if not spooled:
+                    break
+                log.info(f"coalesced {len(spooled)} nodes for deletion")
+                # nodes deleted in an earlier round must not be deleted again
+                lkp.clear_instances()
+                delete_instances(sorted(spooled, key=util.natural_sort))
+        # a caller may have spooled just before the lock was released
+        if not spooled_files():
+            return
 
 
 def suspend_nodes(nodelist):
@@ -123,8 +323,13 @@ def suspend_nodes(nodelist):
             tpu_nodes.append(node)
             nodes.remove(node)
 
-    delete_instances(nodes)
     delete_tpu_instances(tpu_nodes)
+    nodes = pool_instances(nodes)
+    window = lkp.cfg.suspend_coalesce_window
+    if window and nodes:
+        coalesce_deletes(nodes, window)
+    else:
+        delete_instances(nodes)
 
 
 def main(nodelist):
@@ -136,11 +341,15 @@ def main(nodelist):
     cloud_nodes, local_nodes = lkp.filter_nodes(nodes)
     if len(local_nodes) > 0:
         log.debug(
-            f"Ignoring slurm-gcp external nodes '{util.to_hostlist(local_nodes)}' from '{nodelist}'"
+            "Ignoring slurm-gcp external nodes '%s' from '%s'",
+            Lazy(util.to_hostlist, local_nodes),
+            nodelist,
         )
     if len(cloud_nodes) > 0:
         log.debug(
-            f"Using cloud nodes '{util.to_hostlist(cloud_nodes)}' from '{nodelist}'"
+            "Using cloud nodes '%s' from '%s'",
+            Lazy(util.to_hostlist, cloud_nodes),
+            nodelist,
         )
     else:
         log.debug("No cloud nodes to suspend")
@@ -148,6 +357,7 @@ def main(nodelist):
 
     # suspend is allowed to delete exclusive nodes
     log.info(f"suspend {nodelist}")
+    metrics.inc("slurm_gcp_suspend_nodes_total", len(cloud_nodes))
     if lkp.cfg.enable_slurm_gcp_plugins:
         slurm_gcp_plugins.pre_main_suspend_nodes(lkp=lkp, nodelist=nodelist)
     suspend_nodes(nodes)
@@ -174,8 +384,10 @@ parser.add_argument(
 )
 
 
-if __name__ == "__main__":
-    args = parser.parse_args()
+def run_cli(argv=None):
+    """run as SuspendProgram, argv is given by worker.py"""
+    global log
+    args = parser.parse_args(argv)
 
     if cfg.enable_debug_logging:
         args.loglevel = logging.DEBUG
@@ -188,3 +400,7 @@ if __name__ == "__main__":
     sys.excepthook = util.handle_exception
 
     main(args.nodelist)
+
+
+if __name__ == "__main__":
+    run_cli()
@@ -15,30 +15,36 @@
 # limitations under the License.
 
 import argparse
+import atexit
 import collections
+import fcntl
 import importlib.util
-import inspect
 import json
 import logging
 import logging.config
 import math
 import os
+import queue
 import re
-import shelve
 import shlex
 import shutil
 import socket
+import struct
 import subprocess
 import sys
 import tempfile
+import threading
 from collections import defaultdict, namedtuple
 from concurrent.futures import ThreadPoolExecutor, as_completed
 from contextlib import contextmanager
+from datetime import datetime
 from functools import lru_cache, reduce, partialmethod
 from itertools import chain, compress, islice
 from pathlib import Path
-from time import sleep, time
+from time import monotonic, sleep, time
+from urllib.parse import quote, unquote
 
+import metrics
 import slurm_gcp_plugins
 
 required_modules = [
@@ -76,7 +82,7 @@ if can_tpu:
     from google.cloud import tpu_v2 as tpu  # noqa: E402
 import google.api_core.exceptions as gExceptions  # noqa: E402
 
-from requests import get as get_url  # noqa: E402
+from requests import get as get_url, put as put_url  # noqa: E402
 from requests.exceptions import RequestException  # noqa: E402
 
 import yaml  # noqa: E402
@@ -96,6 +102,24 @@ if ENV_CONFIG_YAML:
 else:
     CONFIG_FILE = Path(__file__).with_name("config.yaml")
 API_REQ_LIMIT = 2000
+# idle Http connections kept per api client for later requests
+HTTP_POOL_SIZE = 32
+# records below the log level kept for the next error, with structured logging
+LOG_RING_SIZE = 1000
+# TPU api requests per second
+TPU_REQ_RATE = 10
+# boot failure polls (guest attribute reads) per second, apart from other calls
+BOOT_POLL_RATE = 2
+# TPU node operations in flight per zone, and seconds between polls of them
+TPU_MAX_INFLIGHT = 16
+TPU_POLL_INTERVAL = 10
+# guest attribute namespace of the boot phase times of an instance
+BOOT_PHASE_NAMESPACE = "slurm-boot"
+# instance statuses of a node kept in its nodeset's warm pool
+WARM_POOL_STATUSES = frozenset(("STOPPING", "TERMINATED", "SUSPENDING", "SUSPENDED"))
+# seconds before cached lookups are fetched again
+MACHINE_TYPES_CACHE_AGE = 24 * 60 * 60
+RESERVATION_CACHE_AGE = 5 * 60
 URI_REGEX = r"[a-z]([-a-z0-9]*[a-z0-9])?"
 
 def_creds, auth_project = google.auth.default()
@@ -182,6 +206,9 @@ class FlagLogAdapter(logging.LoggerAdapter):
     def enabled(self):
         return cfg.extra_logging_flags.get(self.flag, False)
 
+    def isEnabledFor(self, level):
+        return self.enabled and super().isEnabledFor(level)
+
     def process(self, msg, kwargs):
         extra = kwargs.setdefault("extra", {})
         extra.update(self.extra)
@@ -189,6 +216,122 @@ class FlagLogAdapter(logging.LoggerAdapter):
         return msg, kwargs
 
 
+class Lazy:
+    """log message argument rendered only when its record is written, eg.
+    log.debug("groups: %s", Lazy(yaml.safe_dump, groups))
+    With structured logging that happens on the logging thread, so the
+    arguments must not change after being logged.
+    """
+
+    __slots__ = ("func", "args", "text")
+
+    def __init__(self, func, *args):
+        self.func = func
+        self.args = args
+        self.text = None
+
+    def __str__(self):
+        # once for all the handlers writing it
+        if self.text is None:
+            self.text = str(self.func(*self.args))
+        return self.text
+
+
+class JsonFormatter(logging.Formatter):
+    """formats log records as JSON lines"""
+
+    def format(self, record):
+        entry = {
+            "time": self.formatTime(record),
+            "level": record.levelname,
+            "logger": record.name,
+            "pid": record.process,
+            "func": record.funcName,
+            "message": record.getMessage(),
+        }
+        flag = getattr(record, "flag", None)
+        if flag is not None:
+            entry["flag"] = flag
+        if record.exc_info:
+            entry["exception"] = self.formatException(record.exc_info)
+        return json.dumps(entry, default=str)
+
+
+class AsyncLogHandler(logging.Handler):
+    """hands records to a thread that writes them to handlers
+    Records below the level of all handlers are kept in a ring of the latest
+    ring_size instead, and written ahead of the next error record.
+    """
+
+    def __init__(self, handlers, ring_size=LOG_RING_SIZE):
+        super().__init__()
+        self.handlers = handlers
+        self.write_level = min(handler.level for handler in handlers)
+        self.ring = collections.deque(maxlen=ring_size)
+        self._start()
+
+    def _start(self):
+        self._pid = os.getpid()
+        self._queue = queue.SimpleQueue()
+        self._thread = threading.Thread(target=self._run, name="logging", daemon=True)
+        self._thread.start()
+
+    def _check_fork(self):
+        if self._pid != os.getpid():
+            # forked, the thread and the ring are the parent's
+            self.ring.clear()
+            self._start()
+
+    def emit(self, record):
+        self._check_fork()
+        self._queue.put(record)
+
+    def _run(self):
+        while True:
+            item = self._queue.get()
+            if item is None:
+                return
+            if isinstance(item, threading.Event):
+                for handler in self.handlers:
+                    handler.flush()
+                item.set()
+                continue
+            self._write(item)
+
+    def _write(self, record):
+        if record.levelno < self.write_level:
+            self.ring.append(record)
+            return
+        if record.levelno >= logging.ERROR:
+            while self.ring:
+                self._dispatch(self.ring.popleft(), force=True)
+        self._dispatch(record)
+
+    def _dispatch(self, record, force=False):
+        for handler in self.handlers:
+            if force or record.levelno >= handler.level:
+                try:
+                    handler.handle(record)
+                except Exception:
+                    handler.handleError(record)
+
+    def flush(self, timeout=10):
+        """wait for the records logged so far to be written"""
+        self._check_fork()
+        done = threading.Event()
+        self._queue.put(done)
+        done.wait(timeout)
+
+    def close(self):
+        if self._pid == os.getpid() and self._thread.is_alive():
+            self.flush()
+            self._queue.put(None)
+            self._thread.join(timeout=10)
+        for handler in self.handlers:
+            handler.close()
+        super().close()
+
+
 logging.basicConfig(level=logging.INFO, stream=sys.stdout)
 log = logging.getLogger(__name__)
 logging_flags = [
@@ -318,14 +461,65 @@ def reservation_resource_policies(reservation):
     return [u.split("/")[-1] for u in reservation.get("resourcePolicies", {}).values()]
 
 
+class HttpPool:
+    """Http of an api client that sends each request on an idle Http of a pool
+    httplib2.Http is not thread-safe. Borrowing one per request lets threads
+    share a client, while each Http keeps its connections alive for the next
+    request to reuse, whichever thread makes it. Connections are not shared
+    with forked children, eg. of worker.py.
+    """
+
+    def __init__(self, new_http, size=HTTP_POOL_SIZE):
+        self.new_http = new_http
+        self.size = size
+        self._idle = []
+        self._lock = threading.Lock()
+        self._pid = os.getpid()
+
+    def _take(self):
+        if self._pid != os.getpid():
+            # forked, the idle connections are the parent's
+            self._idle = []
+            self._lock = threading.Lock()
+            self._pid = os.getpid()
+        with self._lock:
+            return self._idle.pop() if self._idle else None
+
+    def request(self, *args, **kwargs):
+        http = self._take()
+        if http is None:
+            http = self.new_http()
+        try:
+            response = http.request(*args, **kwargs)
+        except Exception:
+            # the connection may be left mid response
+            http.close()
+            raise
+        with self._lock:
+            if len(self._idle) < self.size:
+                self._idle.append(http)
+                http = None
+        if http is not None:
+            http.close()
+        return response
+
+    def close(self):
+        with self._lock:
+            idle, self._idle = self._idle, []
+        for http in idle:
+            http.close()
+
+
 def compute_service(credentials=None, user_agent=USER_AGENT, version="v1"):
     """Make thread-safe compute service handle
-    creates a new Http for each request
+    The handle is made once per process for the same arguments and credentials.
     """
-    try:
-        key_path = os.environ["GOOGLE_APPLICATION_CREDENTIALS"]
-    except KeyError:
-        key_path = None
+    key_path = os.environ.get("GOOGLE_APPLICATION_CREDENTIALS")
+    return _compute_service(credentials, user_agent, version, key_path)
+
+
+@lru_cache(maxsize=None)
+def _compute_service(credentials, user_agent, version, key_path):
     if key_path is not None:
         credentials = service_account.Credentials.from_service_account_file(
             key_path, scopes=["https://www.googleapis.com/auth/cloud-platform"]
@@ -333,20 +527,22 @@ def compute_service(credentials=None, user_agent=USER_AGENT, version="v1"):
     elif credentials is None:
         credentials = def_creds
 
-    def build_request(http, *args, **kwargs):
-        new_http = httplib2.Http()
+    def new_http():
+        http = httplib2.Http()
         if user_agent is not None:
-            new_http = set_user_agent(new_http, user_agent)
-        if credentials is not None:
-            new_http = google_auth_httplib2.AuthorizedHttp(credentials, http=new_http)
-        return googleapiclient.http.HttpRequest(new_http, *args, **kwargs)
+            http = set_user_agent(http, user_agent)
+        return http
 
+    http = HttpPool(new_http)
+    if credentials is not None:
+        http = google_auth_httplib2.AuthorizedHttp(credentials, http=http)
     log.debug(f"Using version={version} of Google Compute Engine API")
+    # the discovery document shipped with the client, never fetched
     return googleapiclient.discovery.build(
         "compute",
         version,
-        requestBuilder=build_request,
-        credentials=credentials,
+        http=http,
+        static_discovery=True,
     )
 
 
@@ -422,6 +618,19 @@ def fetch_config_yaml_md5():
     return hashlib.md5(hash_str)
 
 
+def fetch_config_version(etag=None, timeout=60):
+    """Fetch the md5 of config.yaml that terraform publishes as project
+    metadata, and its etag. Given the etag of an earlier fetch, wait up to
+    timeout seconds for it to change. None if not published.
+    """
+    return get_metadata_etag(
+        f"{lkp.cfg.slurm_cluster_name}-config-version",
+        etag=etag,
+        timeout=timeout,
+        root=f"{ROOT_URL}/project/attributes",
+    )
+
+
 def load_config_file(path):
     """load config from file"""
     content = None
@@ -457,7 +666,11 @@ def owned_file_handler(filename):
 
 
 def config_root_logger(caller_logger, level="DEBUG", stdout=True, logfile=None):
-    """configure the root logger, disabling all existing loggers"""
+    """configure the root logger, disabling all existing loggers
+    With structured logging, the logfile is written as JSON lines by an
+    AsyncLogHandler, which is also given debug records for its ring.
+    """
+    structured = bool(cfg.enable_structured_logging and logfile)
     handlers = list(compress(("stdout_handler", "file_handler"), (stdout, logfile)))
 
     config = {
@@ -499,7 +712,18 @@ def config_root_logger(caller_logger, level="DEBUG", stdout=True, logfile=None):
     }
     if not logfile:
         del config["handlers"]["file_handler"]
+    if structured:
+        config["formatters"]["json"] = {"()": JsonFormatter}
+        config["handlers"]["file_handler"]["formatter"] = "json"
+        for handler in config["handlers"].values():
+            handler["level"] = level
+        config["root"]["level"] = logging.DEBUG
     logging.config.dictConfig(config)
+    if structured:
+        root = logging.getLogger()
+        file_handler = next(h for h in root.handlers if h.name == "file_handler")
+        root.removeHandler(file_handler)
+        root.addHandler(AsyncLogHandler([file_handler]))
     loggers = (
         __name__,
         "resume",
@@ -517,12 +741,17 @@ def log_api_request(request):
     if log_trace_api.enabled:
         # output the whole request object as pretty yaml
         # the body is nested json, so load it as well
-        rep = json.loads(request.to_json())
-        if rep.get("body", None) is not None:
-            rep["body"] = json.loads(rep["body"])
-        pretty_req = yaml.safe_dump(rep).rstrip()
         # label log message with the calling function
-        log_trace_api.debug(f"{inspect.stack()[1].function}:\n{pretty_req}")
+        caller = sys._getframe(1).f_code.co_name
+        log_trace_api.debug("%s:\n%s", caller, Lazy(pretty_request, request.to_json()))
+
+
+def pretty_request(request_json):
+    """api request json as pretty yaml, the body is nested json as well"""
+    rep = json.loads(request_json)
+    if rep.get("body", None) is not None:
+        rep["body"] = json.loads(rep["body"])
+    return yaml.safe_dump(rep).rstrip()
 
 
 def handle_exception(exc_type, exc_value, exc_trace):
@@ -734,6 +963,48 @@ def get_metadata(path, root=ROOT_URL):
         raise Exception(f"failed to get_metadata from {url}")
 
 
+def get_metadata_etag(path, etag=None, timeout=60, root=ROOT_URL):
+    """Get metadata and its etag, (None, None) if the key does not exist.
+    Given an etag, the metadata server holds the request until the value
+    changes or timeout seconds pass.
+    """
+    HEADERS = {"Metadata-Flavor": "Google"}
+    url = f"{root}/{path}"
+    params = {}
+    if etag is not None:
+        params = {"wait_for_change": "true", "last_etag": etag, "timeout_sec": timeout}
+    try:
+        resp = get_url(url, headers=HEADERS, params=params, timeout=timeout + 10)
+        if resp.status_code == 404:
+            return None, None
+        resp.raise_for_status()
+        return resp.text, resp.headers.get("ETag")
+    except RequestException:
+        log.debug(f"metadata not found ({url})")
+        raise Exception(f"failed to get_metadata from {url}")
+
+
+def set_boot_phase(phase, when=None):
+    """record when a boot phase of this instance was reached, as a guest
+    attribute for slurmsync to collect. Best effort, boot does not depend on it.
+    """
+    url = f"{ROOT_URL}/instance/guest-attributes/{BOOT_PHASE_NAMESPACE}/{phase}"
+    try:
+        put_url(
+            url,
+            data=f"{when or time():.3f}",
+            headers={"Metadata-Flavor": "Google"},
+            timeout=5,
+        ).raise_for_status()
+    except RequestException as e:
+        log.debug(f"failed to set boot phase {phase}: {e}")
+
+
+def parse_gcp_timestamp(timestamp):
+    """epoch seconds of an RFC 3339 timestamp from the compute API"""
+    return datetime.fromisoformat(timestamp.replace("Z", "+00:00")).timestamp()
+
+
 @lru_cache(maxsize=None)
 def instance_metadata(path):
     """Get instance metadata"""
@@ -767,19 +1038,175 @@ def natural_sort(text):
     return [atoi(w) for w in re.split(r"(\d+)", text)]
 
 
-def to_hostlist(nodenames):
-    """make hostlist from list of node names"""
+HostRange = namedtuple("HostRange", "prefix,lo,hi,width")
+host_suffix_regex = re.compile(r"^(?P<prefix>.*?)(?P<num>\d+)$")
+
+
+def _width_equiv(n, wn, m, wm):
+    """mirror of Slurm's _width_equiv() in hostlist.c
+    returns the combined (wn, wm) widths, or None if they cannot be combined
+    """
+
+    def zero_padded(num, width):
+        return max(width - len(str(num)), 0)
+
+    if wn == wm:
+        return wn, wm
+    npad, nmpad = zero_padded(n, wn), zero_padded(n, wm)
+    mpad, mnpad = zero_padded(m, wm), zero_padded(m, wn)
+    if npad != nmpad and mpad != mnpad:
+        return None
+    if npad != nmpad:
+        return wn, wn
+    return wm, wm
+
+
+def hostlist_compress(hostnames):
+    """compress hostnames into a hostlist expression, in the order given
+    Matches the output of `scontrol show hostlist`.
+    """
+    ranges = []
+    for host in hostnames:
+        m = host_suffix_regex.match(host)
+        if m is None:
+            ranges.append(HostRange(host, None, None, 0))
+            continue
+        num = int(m["num"])
+        hr = HostRange(m["prefix"], num, num, len(m["num"]))
+        tail = ranges[-1] if ranges else None
+        if (
+            tail is not None
+            and tail.lo is not None
+            and tail.prefix == hr.prefix
+            and tail.hi == hr.lo - 1
+        ):
+            widths = _width_equiv(tail.lo, tail.width, hr.lo, hr.width)
+            if widths is not None:
+                ranges[-1] = tail._replace(hi=hr.hi, width=widths[0])
+                continue
+        ranges.append(hr)
+
+    def numstr(hr):
+        lo = f"{hr.lo:0{hr.width}d}"
+        return lo if hr.hi == hr.lo else f"{lo}-{hr.hi:0{hr.width}d}"
+
+    def within_range(h1, h2):
+        return h1.prefix == h2.prefix and h1.lo is not None and h2.lo is not None
+
+    parts = []
+    i = 0
+    while i < len(ranges):
+        hr = ranges[i]
+        if hr.lo is None:
+            parts.append(hr.prefix)
+            i += 1
+            continue
+        group = [hr]
+        while i + 1 < len(ranges) and within_range(ranges[i], ranges[i + 1]):
+            i += 1
+            group.append(ranges[i])
+        i += 1
+        if len(group) == 1 and hr.lo == hr.hi:
+            parts.append(f"{hr.prefix}{numstr(hr)}")
+        else:
+            parts.append(f"{hr.prefix}[{','.join(map(numstr, group))}]")
+    return ",".join(parts)
+
+
+def _split_hostlist(hostlist):
+    """split hostlist expression on separators outside of brackets"""
+    tokens = []
+    depth = 0
+    token = []
+    for c in hostlist:
+        if c in "[]":
+            depth += 1 if c == "[" else -1
+            if depth not in (0, 1):
+                raise ValueError(f"unbalanced brackets in hostlist '{hostlist}'")
+        if depth == 0 and c in ", \t\n":
+            tokens.append("".join(token))
+            token = []
+        else:
+            token.append(c)
+    if depth != 0:
+        raise ValueError(f"unbalanced brackets in hostlist '{hostlist}'")
+    tokens.append("".join(token))
+    return [t for t in tokens if t]
+
+
+def _expand_range_list(range_list):
+    """expand the inside of a bracket, eg. 01-03,7 -> 01,02,03,7"""
+    for rng in range_list.split(","):
+        lo, sep, hi = rng.partition("-")
+        if not lo.isdigit() or (sep and not hi.isdigit()):
+            raise ValueError(f"invalid range '{rng}'")
+        width = len(lo)
+        lo, hi = int(lo), int(hi) if sep else int(lo)
+        if hi < lo:
+            raise ValueError(f"invalid range '{rng}'")
+        for n in range(lo, hi + 1):
+            yield f"{n:0{width}d}"
+
+
+def _expand_host_expr(expr):
+    """expand a single host expression, which may have several brackets"""
+    start = expr.find("[")
+    if start < 0:
+        yield expr
+        return
+    end = expr.index("]", start)
+    prefix, suffix = expr[:start], expr[end + 1 :]
+    suffixes = list(_expand_host_expr(suffix))
+    for num in _expand_range_list(expr[start + 1 : end]):
+        for suf in suffixes:
+            yield f"{prefix}{num}{suf}"
+
+
+def hostlist_expand(hostlist):
+    """expand hostlist expression into hostnames, in order
+    Matches the output of `scontrol show hostnames`.
+    """
+    return list(chain.from_iterable(map(_expand_host_expr, _split_hostlist(hostlist))))
+
+
+def _to_hostlist_scontrol(nodenames):
     # use tmp file because list could be large
     tmp_file = tempfile.NamedTemporaryFile(mode="w+t", delete=False)
-    tmp_file.writelines("\n".join(sorted(nodenames, key=natural_sort)))
+    tmp_file.writelines("\n".join(nodenames))
     tmp_file.close()
 
     hostlist = run(f"{lkp.scontrol} show hostlist {tmp_file.name}").stdout.rstrip()
-    log_hostlists.debug(f"hostlist({len(nodenames)}): {hostlist}".format(hostlist))
     os.remove(tmp_file.name)
     return hostlist
 
 
+def _to_hostnames_scontrol(hostlist):
+    return run(f"{lkp.scontrol} show hostnames {hostlist}").stdout.splitlines()
+
+
+def to_hostlist(nodenames):
+    """make hostlist from list of node names"""
+    nodenames = sorted(nodenames, key=natural_sort)
+    try:
+        hostlist = hostlist_compress(nodenames)
+    except ValueError as e:
+        log.warning(f"falling back to scontrol to make hostlist: {e}")
+        hostlist = _to_hostlist_scontrol(nodenames)
+    if log_hostlists.enabled:
+        # verify against slurm when debugging hostlists
+        expected = _to_hostlist_scontrol(nodenames)
+        if hostlist != expected:
+            log_hostlists.error(f"hostlist mismatch: {hostlist} != {expected}")
+            hostlist = expected
+    log_hostlists.debug("hostlist(%d): %s", len(nodenames), hostlist)
+    return hostlist
+
+
+def hostlists_yaml(groups):
+    """groups of node names as yaml of their hostlists, for logging"""
+    return yaml.safe_dump({k: to_hostlist(v) for k, v in groups.items()}).rstrip()
+
+
 def part_is_tpu(part):
     """check if partition with name part contains a nodeset of type tpu"""
     return len(lkp.cfg.partitions[part].partition_nodeset_tpu) > 0
@@ -804,11 +1231,134 @@ def to_hostnames(nodelist):
         hostlist = nodelist
     else:
         hostlist = ",".join(nodelist)
-    hostnames = run(f"{lkp.scontrol} show hostnames {hostlist}").stdout.splitlines()
-    log_hostlists.debug(f"hostnames({len(hostnames)}) from {hostlist}")
+    try:
+        hostnames = hostlist_expand(hostlist)
+    except ValueError as e:
+        log.warning(f"falling back to scontrol to expand hostlist: {e}")
+        hostnames = _to_hostnames_scontrol(hostlist)
+    if log_hostlists.enabled:
+        # verify against slurm when debugging hostlists
+        expected = _to_hostnames_scontrol(hostlist) if hostlist else []
+        if hostnames != expected:
+            log_hostlists.error(f"hostnames mismatch for {hostlist}")
+            hostnames = expected
+    log_hostlists.debug("hostnames(%d) from %s", len(hostnames), hostlist)
     return hostnames
 
 
+class SlurmUpdates:
+    """node and job updates collected over a pass, then applied with one
+    scontrol command per distinct set of parameters, on hostlists and job
+    lists. Updates may be added from several threads.
+    """
+
+    # names per scontrol command
+    CHUNK_SIZE = 1000
+
+    def __init__(self):
+        self._lock = threading.Lock()
+        self._reset()
+
+    def _reset(self):
+        # parameters: names, dicts keep the order updates were added in
+        self._holds = {}
+        self._jobs = {}
+        self._notify = {}
+        self._nodes = {}
+
+    def _add(self, updates, key, names):
+        with self._lock:
+            updates.setdefault(key, {}).update(dict.fromkeys(map(str, names)))
+
+    def update_nodes(self, nodes, **params):
+        self._add(self._nodes, tuple(params.items()), nodes)
+
+    def update_jobs(self, job_ids, **params):
+        self._add(self._jobs, tuple(params.items()), job_ids)
+
+    def hold_jobs(self, job_ids):
+        self._add(self._holds, (), job_ids)
+
+    def notify_jobs(self, job_ids, message):
+        self._add(self._notify, message, job_ids)
+
+    # scontrol errors naming a node or job, which bisecting can isolate
+    NAME_ERRORS = re.compile(
+        r"invalid (node name|job id)|job has already finished", re.IGNORECASE
+    )
+    # scontrol calls spent bisecting one chunk
+    SPLIT_CALLS = 32
+
+    def _run(self, command, names, budget=None):
+        """run command on names. When scontrol rejects a node or job name,
+        bisect within SPLIT_CALLS calls to find the names it fails for; any
+        other error fails all names. returns name: error of those
+        """
+        if budget is None:
+            budget = [self.SPLIT_CALLS]
+        budget[0] -= 1
+        try:
+            run(command(names), timeout=30)
+            return {}
+        except subprocess.TimeoutExpired as e:
+            return dict.fromkeys(names, f"timed out after {e.timeout} seconds")
+        except subprocess.SubprocessError as e:
+            err = (getattr(e, "stderr", None) or str(e)).strip()
+            if len(names) == 1 or budget[0] < 2 or not self.NAME_ERRORS.search(err):
+                return dict.fromkeys(names, err)
+        mid = len(names) // 2
+        failed = self._run(command, names[:mid], budget)
+        if budget[0] < 1:
+            # out of calls, the rest fail with the error that split them
+            return {**failed, **dict.fromkeys(names[mid:], err)}
+        return {**failed, **self._run(command, names[mid:], budget)}
+
+    def apply(self):
+        """run the collected updates, job updates before node updates
+        returns the nodes and jobs that failed to update, with the error
+        """
+        with self._lock:
+            holds, jobs, notify, nodes = (
+                self._holds,
+                self._jobs,
+                self._notify,
+                self._nodes,
+            )
+            self._reset()
+
+        def params_str(params):
+            return " ".join(f"{k}={shlex.quote(str(v))}" for k, v in params)
+
+        def hold(ids):
+            return f"{lkp.scontrol} hold {','.join(ids)}"
+
+        def job_update(params):
+            return lambda ids: f"{lkp.scontrol} update jobid={','.join(ids)} {params}"
+
+        def notify_job(message):
+            # one job per notify
+            return lambda ids: f"{lkp.scontrol} notify {ids[0]} {shlex.quote(message)}"
+
+        def node_update(params):
+            return lambda nodes: (
+                f"{lkp.scontrol} update nodename={to_hostlist(nodes)} {params}"
+            )
+
+        commands = chain(
+            ((hold, ids) for ids in holds.values()),
+            ((job_update(params_str(p)), ids) for p, ids in jobs.items()),
+            ((notify_job(m), [i]) for m, ids in notify.items() for i in ids),
+            ((node_update(params_str(p)), nodes) for p, nodes in nodes.items()),
+        )
+        failed = {}
+        for command, names in commands:
+            for chunk in chunked(names, n=self.CHUNK_SIZE):
+                failed.update(self._run(command, chunk))
+        for err, names in groupby_unsorted(list(failed), lambda n: failed[n]):
+            log.error(f"scontrol update failed: {err} ({','.join(names)})")
+        return failed
+
+
 def retry_exception(exc):
     """return true for exceptions that should always be retried"""
     retry_errors = (
@@ -818,17 +1368,137 @@ def retry_exception(exc):
     return any(e in str(exc) for e in retry_errors)
 
 
-def ensure_execute(request):
-    """Handle rate limits and socket time outs"""
+class RateLimiter:
+    """Token bucket with an AIMD rate, shared by all processes on this host
+    The bucket lives in a small locked file in shared memory, so resume,
+    suspend and slurmsync running at once pace against the same quota. The
+    rate is halved on rate limit errors and climbs back to max_rate over
+    RECOVERY seconds.
+    """
+
+    RECOVERY = 60
+    # tokens, refill stamp, current rate, last backoff stamp
+    state_format = struct.Struct("dddd")
+
+    def __init__(self, name, max_rate, burst):
+        self.name = name
+        self.max_rate = max_rate
+        self.min_rate = max_rate / 20
+        self.burst = burst
+        self._lock = threading.Lock()
+        self._local = b""
+        shm = Path("/dev/shm")
+        path = (shm if shm.is_dir() else Path(tempfile.gettempdir())) / (
+            f"slurm_gcp_{name}.rate"
+        )
+        try:
+            self._fd = os.open(path, os.O_RDWR | os.O_CREAT, 0o660)
+        except OSError as e:
+            log.debug(f"rate limiter {name} is not shared: {e}")
+            self._fd = None
+        else:
+            try:
+                # root and slurm processes share it through the slurm group,
+                # only the owner can change its mode and group
+                os.fchmod(self._fd, 0o660)
+                shutil.chown(path, group="slurm")
+            except (LookupError, OSError):
+                pass
+
+    @contextmanager
+    def _state(self):
+        """refilled bucket state as a list, written back on exit"""
+        with self._lock:
+            if self._fd is not None:
+                fcntl.lockf(self._fd, fcntl.LOCK_EX)
+            try:
+                if self._fd is not None:
+                    data = os.pread(self._fd, self.state_format.size, 0)
+                else:
+                    data = self._local
+                now = monotonic()
+                if len(data) == self.state_format.size:
+                    state = list(self.state_format.unpack(data))
+                else:
+                    state = [self.burst, now, self.max_rate, 0.0]
+                tokens, stamp, rate, _ = state
+                elapsed = max(now - stamp, 0)
+                state[0] = min(self.burst, tokens + rate * elapsed)
+                state[1] = now
+                state[2] = min(
+                    self.max_rate, rate + self.max_rate / self.RECOVERY * elapsed
+                )
+                yield state
+                data = self.state_format.pack(*state)
+                if self._fd is not None:
+                    os.pwrite(self._fd, data, 0)
+                else:
+                    self._local = data
+            finally:
+                if self._fd is not None:
+                    fcntl.lockf(self._fd, fcntl.LOCK_UN)
+
+    def acquire(self, cost=1):
+        """block until cost tokens are available and take them
+        costs bigger than the bucket wait for a full bucket and go into debt
+        """
+        need = min(cost, self.burst)
+        while True:
+            with self._state() as state:
+                if state[0] >= need:
+                    state[0] -= cost
+                    return
+                wait = (need - state[0]) / state[2]
+            log.debug(f"rate limiter {self.name}: waiting {wait:.2f}s")
+            metrics.inc("slurm_gcp_rate_limit_wait_seconds_total", wait, api=self.name)
+            sleep(wait)
+
+    def backoff(self):
+        """multiplicative decrease, at most once a second"""
+        metrics.inc("slurm_gcp_rate_limit_backoffs_total", api=self.name)
+        with self._state() as state:
+            state[0] = min(state[0], 0)
+            if state[1] - state[3] >= 1:
+                state[2] = max(state[2] / 2, self.min_rate)
+                state[3] = state[1]
+                log.info(f"rate limiter {self.name}: rate now {state[2]:.1f}/s")
+
+
+@lru_cache(maxsize=None)
+def rate_limiter(api="compute"):
+    # Compute API default is 2000 requests per 100 seconds
+    limits = {
+        "compute": (API_REQ_LIMIT / 100, API_REQ_LIMIT),
+        "tpu": (TPU_REQ_RATE, TPU_REQ_RATE * 10),
+        "boot_poll": (BOOT_POLL_RATE, BOOT_POLL_RATE * 10),
+    }
+    return RateLimiter(api, *limits[api])
+
+
+def request_method(request):
+    """api method of a request, eg. compute.instances.bulkInsert"""
+    return getattr(request, "methodId", None) or "batch"
+
 
+def ensure_execute(request, cost=1, limiter=None):
+    """Handle rate limits and socket time outs
+    cost is the number of api requests this makes, eg. for a batch request
+    """
+    limiter = limiter or rate_limiter()
+    method = request_method(request)
     for retry, wait in enumerate(backoff_delay(0.5, timeout=10 * 60, count=20)):
+        limiter.acquire(cost)
+        metrics.inc("slurm_gcp_api_requests_total", method=method)
         try:
             return request.execute()
         except googleapiclient.errors.HttpError as e:
             if retry_exception(e):
+                limiter.backoff()
+                metrics.inc("slurm_gcp_api_retries_total", method=method)
                 log.error(f"retry:{retry} '{e}'")
                 sleep(wait)
                 continue
+            metrics.inc("slurm_gcp_api_errors_total", method=method)
             raise
 
         except socket.timeout as e:
@@ -842,25 +1512,27 @@ def ensure_execute(request):
         break
 
 
-def batch_execute(requests, compute=compute, retry_cb=None):
+def batch_execute(requests, compute=compute, retry_cb=None, limiter=None):
     """execute list or dict<req_id, request> as batch requests
     retry if retry_cb returns true
+    limiter paces the requests, the shared compute rate limiter by default
     """
     BATCH_LIMIT = 1000
     if not isinstance(requests, dict):
         requests = {str(k): v for k, v in enumerate(requests)}  # rid generated here
     done = {}
     failed = {}
-    timestamps = []
-    rate_limited = False
+    limiter = limiter or rate_limiter()
 
     def batch_callback(rid, resp, exc):
-        nonlocal rate_limited
         if exc is not None:
             log.error(f"compute request exception {rid}: {exc}")
+            method = request_method(requests[rid])
             if retry_exception(exc):
-                rate_limited = True
+                limiter.backoff()
+                metrics.inc("slurm_gcp_api_retries_total", method=method)
             else:
+                metrics.inc("slurm_gcp_api_errors_total", method=method)
                 req = requests.pop(rid)
                 failed[rid] = (req, exc)
         else:
@@ -872,28 +1544,24 @@ def batch_execute(requests, compute=compute, retry_cb=None):
     def batch_request(reqs):
         batch = compute.new_batch_http_request(callback=batch_callback)
         for rid, req in reqs:
+            metrics.inc("slurm_gcp_api_requests_total", method=request_method(req))
             batch.add(req, request_id=rid)
-        return batch
-
-    while requests:
-        if timestamps:
-            timestamps = [stamp for stamp in timestamps if stamp > time()]
-        if rate_limited and timestamps:
-            stamp = next(iter(timestamps))
-            sleep(max(stamp - time(), 0))
-            rate_limited = False
-        # up to API_REQ_LIMIT (2000) requests
-        # in chunks of up to BATCH_LIMIT (1000)
-        batches = [
-            batch_request(chunk)
-            for chunk in chunked(islice(requests.items(), API_REQ_LIMIT), BATCH_LIMIT)
-        ]
-        timestamps.append(time() + 100)
-        with ThreadPoolExecutor() as exe:
-            futures = []
-            for batch in batches:
-                future = exe.submit(ensure_execute, batch)
-                futures.append(future)
+        return batch, len(reqs)
+
+    with ThreadPoolExecutor() as exe:
+        while requests:
+            # up to API_REQ_LIMIT (2000) requests
+            # in chunks of up to BATCH_LIMIT (1000), paced by the rate limiter
+            batches = [
+                batch_request(chunk)
+                for chunk in chunked(
+                    islice(requests.items(), API_REQ_LIMIT), BATCH_LIMIT
+                )
+            ]
+            futures = [
+                exe.submit(ensure_execute, batch, cost, limiter)
+                for batch, cost in batches
+            ]
             for future in futures:
                 result = future.exception()
                 if result is not None:
@@ -934,6 +1602,7 @@ def wait_for_operation(operation, project=None, compute=compute):
     while True:
         result = ensure_execute(wait_req)
         if result["status"] == "DONE":
+            observe_operation(result)
             log_errors = " with errors" if "error" in result else ""
             log.debug(
                 f"operation complete{log_errors}: type={result['operationType']}, name={result['name']}"
@@ -957,6 +1626,43 @@ def wait_for_operations_async(operations, project=None, compute=compute):
     return batch_execute(requests, retry_cb=operation_retry)
 
 
+def observe_operation(op):
+    """record the latency of a finished operation"""
+    if "insertTime" in op and "endTime" in op:
+        metrics.observe(
+            "slurm_gcp_operation_seconds",
+            parse_gcp_timestamp(op["endTime"]) - parse_gcp_timestamp(op["insertTime"]),
+            type=op.get("operationType", "unknown"),
+        )
+
+
+def operation_error(op):
+    """first error message of a failed operation"""
+    error = op["error"]["errors"][0]
+    return error.get("message", error.get("code"))
+
+
+def batch_execute_wait(requests, compute=compute):
+    """batch_execute dict<req_id, request> of operation requests, then wait on
+    all the operations in batches too
+    returns the finished operations that succeeded and the errors of the rest,
+    both by req_id
+    """
+    done, failed = batch_execute(requests, compute=compute)
+    errors = {rid: exc for rid, (_, exc) in failed.items()}
+    waits = {rid: wait_request(op, compute=compute) for rid, op in done.items()}
+    done, failed = batch_execute(
+        waits, compute=compute, retry_cb=lambda op: op["status"] != "DONE"
+    )
+    errors.update((rid, exc) for rid, (_, exc) in failed.items())
+    errors.update(
+        (rid, operation_error(op)) for rid, op in done.items() if "error" in op
+    )
+    for op in done.values():
+        observe_operation(op)
+    return {rid: op for rid, op in done.items() if rid not in errors}, errors
+
+
 def get_filtered_operations(
     op_filter,
     zone=None,
@@ -1131,7 +1837,7 @@ class TPU:
             req = tpu.GetAcceleratorTypeRequest(
                 name=f"{self._parent}/acceleratorTypes/{nodeset.node_type}"
             )
-            self.ac = self._client.get_accelerator_type(req).accelerator_configs[0]
+            self.ac = self._api("get_accelerator_type", req).accelerator_configs[0]
         self.vmcount = self.__calc_vm_from_topology(self.ac.topology)
 
     @property
@@ -1173,7 +1879,7 @@ class TPU:
             request = tpu.GetAcceleratorTypeRequest(
                 name=f"{self._parent}/acceleratorTypes/{self.node_type}"
             )
-            return self._client.get_accelerator_type(request=request) is not None
+            return self._api("get_accelerator_type", request) is not None
         except Exception:
             return False
 
@@ -1182,10 +1888,25 @@ class TPU:
             request = tpu.GetRuntimeVersionRequest(
                 name=f"{self._parent}/runtimeVersions/{self.tf_version}"
             )
-            return self._client.get_runtime_version(request=request) is not None
+            return self._api("get_runtime_version", request) is not None
         except Exception:
             return False
 
+    def _api(self, method, request):
+        """call TPU api method, paced by the shared tpu rate limiter"""
+        limiter = rate_limiter("tpu")
+        limiter.acquire()
+        metrics.inc("slurm_gcp_api_requests_total", method=f"tpu.{method}")
+        try:
+            return getattr(self._client, method)(request=request)
+        except gExceptions.TooManyRequests:
+            limiter.backoff()
+            metrics.inc("slurm_gcp_api_retries_total", method=f"tpu.{method}")
+            raise
+        except Exception:
+            metrics.inc("slurm_gcp_api_errors_total", method=f"tpu.{method}")
+            raise
+
     def __calc_vm_from_topology(self, topology):
         topo = topology.split("x")
         tot = 1
@@ -1205,7 +1926,7 @@ class TPU:
     def list_nodes(self):
         try:
             request = tpu.ListNodesRequest(parent=self._parent)
-            res = self._client.list_nodes(request=request)
+            res = self._api("list_nodes", request)
         except gExceptions.NotFound:
             res = None
         return res
@@ -1215,41 +1936,45 @@ class TPU:
 
     def start_node(self, nodename):
         request = tpu.StartNodeRequest(name=f"{self._parent}/nodes/{nodename}")
-        resp = self._client.start_node(request=request).result()
+        resp = self._api("start_node", request).result()
         return self.__check_resp(resp, "start")
 
     def stop_node(self, nodename):
         request = tpu.StopNodeRequest(name=f"{self._parent}/nodes/{nodename}")
-        resp = self._client.stop_node(request=request).result()
+        resp = self._api("stop_node", request).result()
         return self.__check_resp(resp, "stop")
 
     def get_node(self, nodename):
         try:
             request = tpu.GetNodeRequest(name=f"{self._parent}/nodes/{nodename}")
-            res = self._client.get_node(request=request)
+            res = self._api("get_node", request)
         except gExceptions.NotFound:
             res = None
         return res
 
-    def _register_node(self, nodename, ip_addr):
-        dns_name = socket.getnameinfo((ip_addr, 0), 0)[0]
+    def _register_nodes(self, nodenames, ip_addrs):
+        """point slurm at the vms of a slice, in one update"""
+        dns_names = [socket.getnameinfo((ip_addr, 0), 0)[0] for ip_addr in ip_addrs]
         run(
-            f"{lkp.scontrol} update nodename={nodename} nodeaddr={ip_addr} nodehostname={dns_name}"
+            f"{lkp.scontrol} update nodename={','.join(nodenames)} nodeaddr={','.join(ip_addrs)} nodehostname={','.join(dns_names)}"
         )
 
-    def create_node(self, nodename):
+    def create_node_request(self, nodename):
+        """request to create the slice for nodename (a list if multi-vm)
+        returns None if nodename does not match the slice size
+        """
         if self.vmcount > 1 and not isinstance(nodename, list):
             log.error(
                 f"Tried to create a {self.vmcount} node TPU on nodeset {self._nodeset.nodeset_name} but only received one nodename {nodename}"
             )
-            return False
+            return None
         if self.vmcount > 1 and (
             isinstance(nodename, list) and len(nodename) != self.vmcount
         ):
             log.error(
                 f"Expected to receive a list of {self.vmcount} nodenames for TPU node creation in nodeset {self._nodeset.nodeset_name}, but received this list {nodename}"
             )
-            return False
+            return None
 
         node = tpu.Node()
         node.accelerator_config = self.ac
@@ -1293,43 +2018,366 @@ class TPU:
         if self.data_disks:
             node.data_disks = self.data_disks
 
-        request = tpu.CreateNodeRequest(parent=self._parent, node=node, node_id=node_id)
-        resp = self._client.create_node(request=request).result()
-        if not self.__check_resp(resp, "create"):
+        return tpu.CreateNodeRequest(parent=self._parent, node=node, node_id=node_id)
+
+    def node_request(self, action, nodename):
+        """request for one of the TPUJob actions"""
+        if action == "create":
+            return self.create_node_request(nodename)
+        request_types = {
+            "start": tpu.StartNodeRequest,
+            "stop": tpu.StopNodeRequest,
+            "delete": tpu.DeleteNodeRequest,
+        }
+        return request_types[action](name=f"{self._parent}/nodes/{nodename}")
+
+    def node_done(self, action, nodename, resp):
+        """check the result of a finished node operation, register created nodes
+        returns True on success
+        """
+        if action == "delete" and not resp:
             return False
-        if isinstance(nodename, list):
-            for node_id, net_endpoint in zip(nodename, resp.network_endpoints):
-                self._register_node(node_id, net_endpoint.ip_address)
+        if not self.__check_resp(resp, action):
+            return False
+        if action == "create":
+            nodenames = nodename if isinstance(nodename, list) else [nodename]
+            ip_addrs = [endpoint.ip_address for endpoint in resp.network_endpoints]
+            # a vm without an endpoint is left unregistered
+            nodenames = nodenames[: len(ip_addrs)]
+            self._register_nodes(nodenames, ip_addrs[: len(nodenames)])
+        return True
+
+    def create_node(self, nodename):
+        request = self.create_node_request(nodename)
+        if request is None:
+            return False
+        resp = self._api("create_node", request).result()
+        return self.node_done("create", nodename, resp)
+
+    def delete_not_found(self, nodename):
+        """log a delete of a node that does not exist, returns True"""
+        # log only error if vmcount is 1 as for other tpu vm count, this could be "phantom" nodes
+        if self.vmcount == 1:
+            log.error(f"Tpu single node {nodename} not found")
         else:
-            ip_add = resp.network_endpoints[0].ip_address
-            self._register_node(nodename, ip_add)
+            # for the TPU nodes that consist in more than one vm, only the first node of the TPU a.k.a. the master node will
+            # exist as real TPU nodes, so the other ones are expected to not be found, check the hostname of the node that has
+            # not been found, and if it ends in 0, it means that is the master node and it should have been found, and in consequence
+            # log an error
+            nodehostname = yaml.safe_load(
+                run(f"{lkp.scontrol} --yaml show node {nodename}").stdout.rstrip()
+            )["nodes"][0]["hostname"]
+            if nodehostname.split("-")[-1] == "0":
+                log.error(f"TPU master node {nodename} not found")
+            else:
+                log.info(f"Deleted TPU 'phantom' node {nodename}")
+        # If the node is not found it is tecnichally deleted, so return success.
         return True
 
     def delete_node(self, nodename):
-        request = tpu.DeleteNodeRequest(name=f"{self._parent}/nodes/{nodename}")
+        request = self.node_request("delete", nodename)
         try:
-            resp = self._client.delete_node(request=request).result()
-            if resp:
-                return self.__check_resp(resp, "delete")
-            return False
+            resp = self._api("delete_node", request).result()
+            return self.node_done("delete", nodename, resp)
         except gExceptions.NotFound:
-            # log only error if vmcount is 1 as for other tpu vm count, this could be "phantom" nodes
-            if self.vmcount == 1:
-                log.error(f"Tpu single node {nodename} not found")
+            return self.delete_not_found(nodename)
+
+
+class TPUJob(namedtuple("TPUJob", "tpu,action,nodename,fallback")):
+    """A create, start, stop or delete of one TPU slice for run_tpu_jobs
+    fallback is a TPUJob run if this one fails, eg. delete after a failed stop
+    """
+
+    __slots__ = ()
+
+    def __new__(cls, tpu, action, nodename, fallback=None):
+        return super().__new__(cls, tpu, action, nodename, fallback)
+
+    def __str__(self):
+        nodename = self.nodename
+        if isinstance(nodename, list):
+            nodename = to_hostlist(nodename)
+        return f"{self.action} TPU node {nodename}"
+
+
+def _tpu_op_done(op):
+    """poll a TPU long running operation, paced by the tpu rate limiter"""
+    limiter = rate_limiter("tpu")
+    limiter.acquire()
+    try:
+        return op.done()
+    except gExceptions.TooManyRequests:
+        limiter.backoff()
+        return False
+
+
+def run_tpu_jobs(jobs, max_inflight=TPU_MAX_INFLIGHT, interval=TPU_POLL_INTERVAL):
+    """Run TPUJobs concurrently. Operations are submitted up to max_inflight per
+    zone and all of them are polled from this one loop. A zone that runs out of
+    quota is held to the operations it already has in flight.
+    returns a list of (job, error) for the jobs that failed
+    """
+    queues = defaultdict(collections.deque)
+    for job in jobs:
+        queues[job.tpu.zone].append(job)
+    limits = dict.fromkeys(queues, max_inflight)
+    inflight = {}
+    zone_inflight = collections.Counter()
+    failed = []
+
+    def fail(job, err):
+        if job.fallback is not None:
+            log.warning(f"{job} failed ({err}), will {job.fallback.action} instead")
+            queues[job.tpu.zone].append(job.fallback)
+        else:
+            log.error(f"{job} failed: {err}")
+            failed.append((job, err))
+
+    def submit(job):
+        request = job.tpu.node_request(job.action, job.nodename)
+        if request is None:
+            fail(job, "invalid request")
+            return
+        try:
+            op = job.tpu._api(f"{job.action}_node", request)
+        except gExceptions.NotFound as e:
+            if job.action == "delete":
+                job.tpu.delete_not_found(job.nodename)
             else:
-                # for the TPU nodes that consist in more than one vm, only the first node of the TPU a.k.a. the master node will
-                # exist as real TPU nodes, so the other ones are expected to not be found, check the hostname of the node that has
-                # not been found, and if it ends in 0, it means that is the master node and it should have been found, and in consequence
-                # log an error
-                nodehostname = yaml.safe_load(
-                    run(f"{lkp.scontrol} --yaml show node {nodename}").stdout.rstrip()
-                )["nodes"][0]["hostname"]
-                if nodehostname.split("-")[-1] == "0":
-                    log.error(f"TPU master node {nodename} not found")
+                fail(job, e)
+            return
+        log.debug(f"submitted {job}")
+        inflight[id(op)] = (op, job)
+        zone_inflight[job.tpu.zone] += 1
+
+    while queues or inflight:
+        for zone, queue in list(queues.items()):
+            while queue and zone_inflight[zone] < limits[zone]:
+                job = queue.popleft()
+                try:
+                    submit(job)
+                except gExceptions.ResourceExhausted as e:
+                    if zone_inflight[zone] == 0:
+                        fail(job, e)
+                        continue
+                    log.info(
+                        f"TPU quota reached in {zone} with {zone_inflight[zone]} operations in flight"
+                    )
+                    limits[zone] = zone_inflight[zone]
+                    queue.appendleft(job)
+                    break
+                except Exception as e:
+                    fail(job, e)
+            if not queue:
+                del queues[zone]
+
+        for key, (op, job) in list(inflight.items()):
+            if not _tpu_op_done(op):
+                continue
+            del inflight[key]
+            zone_inflight[job.tpu.zone] -= 1
+            try:
+                resp = op.result()
+            except gExceptions.NotFound as e:
+                if job.action == "delete":
+                    job.tpu.delete_not_found(job.nodename)
                 else:
-                    log.info(f"Deleted TPU 'phantom' node {nodename}")
-            # If the node is not found it is tecnichally deleted, so return success.
-            return True
+                    fail(job, e)
+                continue
+            except Exception as e:
+                fail(job, e)
+                continue
+            if job.tpu.node_done(job.action, job.nodename, resp):
+                log.info(f"{job} done")
+            else:
+                fail(job, "node did not reach the expected state")
+
+        # let freed slots be filled before waiting again
+        if inflight and not any(
+            queues[zone] and zone_inflight[zone] < limits[zone] for zone in queues
+        ):
+            sleep(interval)
+    return failed
+
+
+class NodeState(namedtuple("NodeState", "base,flags")):
+    """Slurm node base state and set of state flags"""
+
+    __slots__ = ()
+
+    # state flags include: CLOUD, COMPLETING, DRAIN, FAIL, POWERED_DOWN,
+    #   POWERING_DOWN
+    base_states = frozenset(
+        ("UNKNOWN", "DOWN", "IDLE", "ALLOCATED", "ERROR", "MIXED", "FUTURE")
+    )
+    cloud_flags = frozenset(("CLOUD", "DYNAMIC_NORM"))
+
+    @property
+    def cloud(self):
+        return not self.cloud_flags.isdisjoint(self.flags)
+
+    @classmethod
+    def from_string(cls, state):
+        """from scontrol text state, eg. IDLE+CLOUD+POWERED_DOWN"""
+        base, *flags = state.split("+")
+        if base.endswith("*"):
+            base = base.rstrip("*")
+            flags.append("NOT_RESPONDING")
+        return cls(base, frozenset(flags))
+
+    @classmethod
+    def from_json(cls, node, cloud_only=False):
+        """from a node in scontrol --json output
+        Returns None for non-cloud nodes if cloud_only is set.
+        """
+        state = node.get("state")
+        if isinstance(state, str):
+            # older data_parser: "state": "idle", "state_flags": [...]
+            flags = frozenset(map(str.upper, node.get("state_flags") or ()))
+            base = state.upper()
+        else:
+            # "state": ["IDLE", "CLOUD", "POWERED_DOWN"]
+            state = frozenset(map(str.upper, state or ()))
+            base = next(iter(state & cls.base_states), "UNKNOWN")
+            flags = state - cls.base_states
+        if cloud_only and cls.cloud_flags.isdisjoint(flags):
+            return None
+        return cls(base, flags)
+
+    def __str__(self):
+        return "+".join(chain((self.base,), sorted(self.flags)))
+
+
+def template_fingerprint(template):
+    """identifies an instance template resource, names can be reused"""
+    return f"{template.get('id')}/{template.get('creationTimestamp')}"
+
+
+class FileCache:
+    """Cache of json values shared by processes on a host, one file per key
+    Readers never lock: a value is written to a temp file and renamed over
+    the old one, so a reader sees either the old or the new value whole.
+    """
+
+    def __init__(self, path):
+        self.path = Path(path)
+
+    def _file(self, key):
+        return self.path / quote(key, safe="")
+
+    def get(self, key, max_age=None):
+        """cached value, None if missing or older than max_age seconds"""
+        try:
+            entry = json.loads(self._file(key).read_bytes())
+        except FileNotFoundError:
+            return None
+        except ValueError as e:
+            log.warning(f"ignoring unreadable cache entry {key}: {e}")
+            return None
+        if max_age is not None and time() - entry["time"] > max_age:
+            return None
+        return entry["value"]
+
+    def keys(self):
+        if not self.path.is_dir():
+            return []
+        return [unquote(p.name) for p in self.path.iterdir() if p.name[0] != "."]
+
+    def set(self, key, value):
+        if not self.path.is_dir():
+            self.path.mkdirp()
+            # cache should be owned by slurm
+            chown_slurm(self.path)
+        path = self._file(key)
+        tmp = path.with_name(f".{path.name}.{os.getpid()}.{threading.get_ident()}")
+        tmp.write_text(json.dumps({"time": time(), "value": value}))
+        os.replace(tmp, path)
+        chown_slurm(path)
+
+    def remove(self, keys):
+        for key in keys:
+            try:
+                self._file(key).unlink()
+            except FileNotFoundError:
+                pass
+
+    @contextmanager
+    def lock(self):
+        """lock the cache against other processes, for read-modify-write"""
+        if not self.path.is_dir():
+            self.path.mkdirp()
+            chown_slurm(self.path)
+        with open(self.path / ".lock", "a") as f:
+            fcntl.lockf(f, fcntl.LOCK_EX)
+            try:
+                yield
+            finally:
+                fcntl.lockf(f, fcntl.LOCK_UN)
+
+
+class InstanceRecord:
+    """Compact record of a listed instance
+    name, zone, status and role are slots, anything else that was requested
+    is kept in fields. Attribute and item access both work, missing fields
+    read as an empty NSDict like they would on a full NSDict instance.
+    """
+
+    __slots__ = ("name", "zone", "status", "role", "fields")
+    # fields records are built from
+    required_fields = ("labels", "name", "status", "zone")
+
+    def __init__(self, name, zone, status, role, fields):
+        self.name = name
+        self.zone = zone
+        self.status = status
+        self.role = role
+        self.fields = fields
+
+    @classmethod
+    def from_api(cls, inst):
+        """from an instance resource, None if it has no slurm role"""
+        inst = dict(inst)
+        zone_link = inst.pop("zone")
+        inst["zoneLink"] = zone_link
+        if "machineType" in inst:
+            inst["machineTypeLink"] = inst["machineType"]
+            inst["machineType"] = trim_self_link(inst["machineType"])
+        if "metadata" in inst:
+            # metadata is fetched as a dict of dicts like:
+            # {'key': key, 'value': value}, kinda silly
+            inst["metadata"] = {
+                i["key"]: i["value"] for i in inst["metadata"].get("items", [])
+            }
+            role = inst["metadata"].get("slurm_instance_role")
+        else:
+            role = inst.get("labels", {}).get("slurm_instance_role")
+        if role is None:
+            return None
+        return cls(
+            inst.pop("name"),
+            trim_self_link(zone_link),
+            inst.pop("status", None),
+            role,
+            NSDict(inst),
+        )
+
+    def __getattr__(self, key):
+        # only called for names that are not slots
+        if key == "fields":
+            raise AttributeError(key)
+        return self.fields[key]
+
+    def __getitem__(self, key):
+        return getattr(self, key)
+
+    def __contains__(self, key):
+        return key in self.__slots__[:-1] or key in self.fields
+
+    def get(self, key, default=None):
+        return getattr(self, key) if key in self else default
+
+    def __repr__(self):
+        return f"InstanceRecord(name={self.name}, zone={self.zone}, status={self.status}, role={self.role})"
 
 
 class Lookup:
@@ -1346,10 +2394,22 @@ class Lookup:
         r")$"
     )
     node_desc_regex = re.compile(regex)
+    node_state_regex = re.compile(r"^NodeName=(?P<name>\S+).*? State=(?P<state>\S+)")
+    # scontrol errors of a slurm without --json or its data_parser plugin
+    json_unsupported_regex = re.compile(
+        r"(unrecognized|invalid|unknown) option|data_parser", re.IGNORECASE
+    )
 
     def __init__(self, cfg=None):
         self._cfg = cfg or NSDict()
-        self.template_cache_path = Path(__file__).parent / "template_info.cache"
+        self.cache = FileCache(Path(__file__).parent / "lookup_cache")
+        # boot phase times of nodes being resumed, by node
+        self.boot_timing = FileCache(Path(__file__).parent / "boot_timing")
+        # instance and slurm node maps are kept until explicitly cleared
+        self._instances = None
+        self._slurm_nodes = None
+        # whether scontrol supports --json, unknown until first used
+        self._slurm_json = None
 
     @property
     def cfg(self):
@@ -1519,30 +2579,54 @@ class Lookup:
         )
         return [static for static in static_nodesets if static is not None]
 
-    @lru_cache(maxsize=None)
-    def slurm_nodes(self):
-        StateTuple = namedtuple("StateTuple", "base,flags")
-
-        def make_node_tuple(node_line):
-            """turn node,state line to (node, StateTuple(state))"""
-            # state flags include: CLOUD, COMPLETING, DRAIN, FAIL, POWERED_DOWN,
-            #   POWERING_DOWN
-            node, fullstate = node_line.split(",")
-            state = fullstate.split("+")
-            state_tuple = StateTuple(state[0], set(state[1:]))
-            return (node, state_tuple)
-
-        cmd = (
-            f"{self.scontrol} show nodes | "
-            r"grep -oP '^NodeName=\K(\S+)|State=\K(\S+)' | "
-            r"paste -sd',\n'"
-        )
-        node_lines = run(cmd, shell=True).stdout.rstrip().splitlines()
-        nodes = {
-            node: state
-            for node, state in map(make_node_tuple, node_lines)
-            if "CLOUD" in state.flags or "DYNAMIC_NORM" in state.flags
-        }
+    def slurm_nodes(self, nodelist=None):
+        """map of cloud node name to NodeState
+        If nodelist is given, only state for those nodes is returned, fetched
+        on its own unless the full map is already loaded.
+        """
+        if nodelist is not None:
+            nodes = to_hostnames(nodelist)
+            if self._slurm_nodes is None:
+                return self._fetch_slurm_nodes(nodes) if nodes else {}
+            return {n: self._slurm_nodes[n] for n in nodes if n in self._slurm_nodes}
+        if self._slurm_nodes is None:
+            self._slurm_nodes = self._fetch_slurm_nodes()
+        return self._slurm_nodes
+
+    def clear_slurm_nodes(self):
+        self._slurm_nodes = None
+
+    def _fetch_slurm_nodes(self, nodes=None):
+        hostlist = to_hostlist(nodes) if nodes else ""
+        if self._slurm_json is not False:
+            result = run(f"{self.scontrol} --json show nodes {hostlist}", check=False)
+            try:
+                node_list = json.loads(result.stdout)["nodes"]
+            except (ValueError, KeyError, TypeError):
+                if self.json_unsupported_regex.search(result.stderr or ""):
+                    log.debug("scontrol json output unsupported, parsing node text")
+                    self._slurm_json = False
+                else:
+                    # retried on the next call
+                    log.debug(f"scontrol json output unavailable: {result.stderr}")
+            else:
+                self._slurm_json = True
+                nodes = {}
+                for node in node_list:
+                    state = NodeState.from_json(node, cloud_only=True)
+                    if state is not None:
+                        nodes[node["name"]] = state
+                return nodes
+
+        result = run(f"{self.scontrol} show nodes --oneliner {hostlist}", check=False)
+        nodes = {}
+        for line in result.stdout.splitlines():
+            m = self.node_state_regex.search(line)
+            if m is None:
+                continue
+            state = NodeState.from_string(m["state"])
+            if state.cloud:
+                nodes[m["name"]] = state
         return nodes
 
     def slurm_node(self, nodename):
@@ -1585,89 +2669,193 @@ class Lookup:
             res.extend(tpuobj.list_node_names())
         return res
 
-    @lru_cache(maxsize=1)
-    def instances(self, project=None, slurm_cluster_name=None):
-        slurm_cluster_name = slurm_cluster_name or self.cfg.slurm_cluster_name
-        project = project or self.project
-        instance_information_fields = [
-            "advancedMachineFeatures",
-            "cpuPlatform",
-            "creationTimestamp",
-            "disks",
-            "disks",
-            "fingerprint",
-            "guestAccelerators",
-            "hostname",
-            "id",
-            "kind",
-            "labelFingerprint",
-            "labels",
-            "lastStartTimestamp",
-            "lastStopTimestamp",
-            "lastSuspendedTimestamp",
-            "machineType",
-            "metadata",
-            "name",
-            "networkInterfaces",
-            "resourceStatus",
-            "scheduling",
-            "selfLink",
-            "serviceAccounts",
-            "shieldedInstanceConfig",
-            "shieldedInstanceIntegrityPolicy",
-            "sourceMachineImage",
-            "status",
-            "statusMessage",
-            "tags",
-            "zone",
-            # "deletionProtection",
-            # "startRestricted",
-        ]
+    def instance_fields(self, project=None, slurm_cluster_name=None, fields=None):
+        """comma separated instance fields to request from the API
+        fields narrows the default set to what a caller needs, the fields
+        instance records are built from and plugin fields are always included
+        """
+        if fields is not None:
+            instance_information_fields = [*InstanceRecord.required_fields, *fields]
+        else:
+            instance_information_fields = [
+                "advancedMachineFeatures",
+                "cpuPlatform",
+                "creationTimestamp",
+                "disks",
+                "disks",
+                "fingerprint",
+                "guestAccelerators",
+                "hostname",
+                "id",
+                "kind",
+                "labelFingerprint",
+                "labels",
+                "lastStartTimestamp",
+                "lastStopTimestamp",
+                "lastSuspendedTimestamp",
+                "machineType",
+                "metadata",
+                "name",
+                "networkInterfaces",
+                "resourceStatus",
+                "scheduling",
+                "selfLink",
+                "serviceAccounts",
+                "shieldedInstanceConfig",
+                "shieldedInstanceIntegrityPolicy",
+                "sourceMachineImage",
+                "status",
+                "statusMessage",
+                "tags",
+                "zone",
+                # "deletionProtection",
+                # "startRestricted",
+            ]
         if lkp.cfg.enable_slurm_gcp_plugins:
             slurm_gcp_plugins.register_instance_information_fields(
                 lkp=lkp,
-                project=project,
-                slurm_cluster_name=slurm_cluster_name,
+                project=project or self.project,
+                slurm_cluster_name=slurm_cluster_name or self.cfg.slurm_cluster_name,
                 instance_information_fields=instance_information_fields,
             )
-        instance_information_fields = sorted(set(instance_information_fields))
-        instance_fields = ",".join(instance_information_fields)
-        fields = f"items.zones.instances({instance_fields}),nextPageToken"
-        flt = f"labels.slurm_cluster_name={slurm_cluster_name} AND name:{slurm_cluster_name}-*"
-        act = self.compute.instances()
-        op = act.aggregatedList(project=project, fields=fields, filter=flt)
+        return ",".join(sorted(set(instance_information_fields)))
 
-        def properties(inst):
-            """change instance properties to a preferred format"""
-            inst["zoneLink"] = inst["zone"]
-            inst["zone"] = trim_self_link(inst["zone"])
-            inst["machineTypeLink"] = inst["machineType"]
-            inst["machineType"] = trim_self_link(inst["machineType"])
-            # metadata is fetched as a dict of dicts like:
-            # {'key': key, 'value': value}, kinda silly
-            metadata = {i["key"]: i["value"] for i in inst["metadata"].get("items", [])}
-            if "slurm_instance_role" not in metadata:
-                return None
-            inst["role"] = metadata["slurm_instance_role"]
-            inst["metadata"] = metadata
-            # del inst["metadata"]  # no need to store all the metadata
-            return NSDict(inst)
+    @staticmethod
+    def instance_properties(inst):
+        """change instance properties to a preferred format
+        returns None for instances without a slurm role
+        """
+        return InstanceRecord.from_api(inst)
 
-        instances = {}
-        while op is not None:
-            result = ensure_execute(op)
-            instance_iter = (
-                (inst["name"], properties(inst))
-                for inst in chain.from_iterable(
-                    m["instances"] for m in result.get("items", {}).values()
-                )
+    @lru_cache(maxsize=None)
+    def region_zones(self, region, project=None):
+        """names of the zones in a region"""
+        project = project or self.project
+        resp = ensure_execute(
+            self.compute.regions().get(project=project, region=region, fields="zones")
+        )
+        return frozenset(trim_self_link(zone) for zone in resp.get("zones", []))
+
+    def nodeset_allowed_zones(self, nodeset, project=None):
+        """zones instances of a nodeset may be created in"""
+        if nodeset.zone_policy_allow:
+            allowed = set(nodeset.zone_policy_allow)
+        else:
+            region = parse_self_link(nodeset.subnetwork).region
+            allowed = set(self.region_zones(region, project=project))
+        return allowed.difference(nodeset.zone_policy_deny or ())
+
+    def nodeset_zones(self, project=None):
+        """zones compute instances of the nodesets may be created in"""
+        zones = set()
+        for nodeset in self.cfg.nodeset.values():
+            zones.update(self.nodeset_allowed_zones(nodeset, project=project))
+        return zones
+
+    def list_instances(
+        self, project=None, slurm_cluster_name=None, flt=None, fields=None, zones=None
+    ):
+        """list cluster instances, flt further narrows the filter and fields
+        narrows the instance fields requested. Zones default to the nodeset
+        zones and are listed in parallel. Empty zones lists every zone with one
+        aggregated list, which also finds instances outside the nodeset zones.
+        """
+        slurm_cluster_name = slurm_cluster_name or self.cfg.slurm_cluster_name
+        project = project or self.project
+        instance_fields = self.instance_fields(project, slurm_cluster_name, fields)
+        flt = " AND ".join(
+            f"({f})"
+            for f in (
+                f"labels.slurm_cluster_name={slurm_cluster_name}",
+                f"name:{slurm_cluster_name}-*",
+                flt,
             )
-            instances.update(
-                {name: props for name, props in instance_iter if props is not None}
+            if f
+        )
+        act = self.compute.instances()
+        if zones is None:
+            zones = self.nodeset_zones(project=project)
+
+        def list_zone(zone):
+            op = act.list(
+                project=project,
+                zone=zone,
+                fields=f"items({instance_fields}),nextPageToken",
+                filter=flt,
+                maxResults=500,
             )
-            op = act.aggregatedList_next(op, result)
+            while op is not None:
+                result = ensure_execute(op)
+                yield from result.get("items", [])
+                op = act.list_next(op, result)
+
+        def list_aggregated():
+            op = act.aggregatedList(
+                project=project,
+                fields=f"items.zones.instances({instance_fields}),nextPageToken",
+                filter=flt,
+            )
+            while op is not None:
+                result = ensure_execute(op)
+                yield from chain.from_iterable(
+                    m["instances"]
+                    for m in result.get("items", {}).values()
+                    if "instances" in m
+                )
+                op = act.aggregatedList_next(op, result)
+
+        def records(items):
+            records = (InstanceRecord.from_api(inst) for inst in items)
+            return {rec.name: rec for rec in records if rec is not None}
+
+        if not zones:
+            return records(list_aggregated())
+        instances = {}
+        with ThreadPoolExecutor(max_workers=min(len(zones), 16)) as exe:
+            for zone_instances in exe.map(
+                lambda zone: records(list_zone(zone)), sorted(zones)
+            ):
+                instances.update(zone_instances)
         return instances
 
+    def instances(
+        self, project=None, slurm_cluster_name=None, fields=None, zones=None
+    ):
+        """cached map of cluster instances
+        fields and zones are passed to list_instances, the cache is reused
+        while it has the fields asked for. Without fields any cached map is used.
+        """
+        key = (project, slurm_cluster_name)
+        if fields is not None:
+            fields = frozenset(self.instance_fields(fields=fields).split(","))
+        cached = self._instances
+        if (
+            cached is None
+            or cached[0] != key
+            or (fields is not None and not fields <= cached[1])
+        ):
+            if cached is not None and cached[0] == key and fields is not None:
+                fields = fields | cached[1]
+            instances = self.list_instances(
+                project=project,
+                slurm_cluster_name=slurm_cluster_name,
+                fields=fields,
+                zones=zones,
+            )
+            fieldset = fields or frozenset(self.instance_fields().split(","))
+            self._instances = (key, fieldset, instances)
+        return self._instances[2]
+
+    def update_instances(self, instances, removed=()):
+        """merge changed instances into the cached instance map"""
+        cached = self.instances()
+        for name in removed:
+            cached.pop(name, None)
+        cached.update(instances)
+
+    def clear_instances(self):
+        self._instances = None
+
     def instance(self, instance_name, project=None, slurm_cluster_name=None):
         instances = self.instances(
             project=project, slurm_cluster_name=slurm_cluster_name
@@ -1677,7 +2865,7 @@ class Lookup:
     def describe_instance(self, instance_name, project=None, zone=None):
         project = project or self.project
         if zone is None:
-            self.instances.cache_clear()
+            self.clear_instances()
             inst = self.instance(instance_name, project=project)
             if inst is None:
                 raise Exception(f"instance {instance_name} not found")
@@ -1693,6 +2881,10 @@ class Lookup:
         """
         See https://cloud.google.com/compute/docs/reference/rest/v1/reservations
         """
+        key = f"reservation:{self.project}/{name}"
+        reservation = self.cache.get(key, max_age=RESERVATION_CACHE_AGE)
+        if reservation is not None:
+            return reservation
         resp = ensure_execute(
             self.compute.reservations().aggregatedList(
                 project=self.project, filter=f"name={name}"
@@ -1710,11 +2902,16 @@ class Lookup:
         assert (
             reservation is not None
         ), f"reservation '{name}' not found in '{self.project}'."
+        self.cache.set(key, reservation)
         return reservation
 
     @lru_cache(maxsize=1)
     def machine_types(self, project=None):
         project = project or self.project
+        key = f"machine_types:{project}"
+        cached = self.cache.get(key, max_age=MACHINE_TYPES_CACHE_AGE)
+        if cached is not None:
+            return defaultdict(dict, cached)
         field_names = "name,zone,guestCpus,memoryMb,accelerators"
         fields = f"items.zones.machineTypes({field_names}),nextPageToken"
 
@@ -1734,6 +2931,7 @@ class Lookup:
                 machines[name][zone] = machine
 
             op = act.aggregatedList_next(op, result)
+        self.cache.set(key, machines)
         return machines
 
     def machine_type(self, machine_type, project=None, zone=None):
@@ -1788,46 +2986,28 @@ class Lookup:
         machine_conf.memory = machine.memoryMb - (400 + (30 * gb))
         return machine_conf
 
-    @contextmanager
-    def template_cache(self, writeback=False):
-        flag = "c" if writeback else "r"
-        err = None
-        for wait in backoff_delay(0.125, timeout=60, count=20):
-            try:
-                cache = shelve.open(
-                    str(self.template_cache_path), flag=flag, writeback=writeback
-                )
-                break
-            except OSError as e:
-                err = e
-                log.debug(f"Failed to access template info cache: {e}")
-                sleep(wait)
-                continue
-        else:
-            # reached max_count of waits
-            raise Exception(f"Failed to access cache file. latest error: {err}")
-        try:
-            yield cache
-        finally:
-            cache.close()
+    @staticmethod
+    def template_cache_key(template_link):
+        # a link with ?uniqueId= pins the template it was made from
+        return f"template:{template_link}"
 
     @lru_cache(maxsize=None)
     def template_info(self, template_link, project=None):
         project = project or self.project
         template_name = trim_self_link(template_link)
-        # split read and write access to minimize write-lock. This might be a
-        # bit slower? TODO measure
-        if self.template_cache_path.exists():
-            with self.template_cache() as cache:
-                if template_name in cache:
-                    return NSDict(cache[template_name])
-
-        template = ensure_execute(
+        key = self.template_cache_key(template_link)
+        cached = self.cache.get(key)
+        if cached is not None:
+            metrics.inc("slurm_gcp_template_info_total", source="file")
+            return NSDict(cached["properties"])
+        metrics.inc("slurm_gcp_template_info_total", source="api")
+
+        resp = ensure_execute(
             self.compute.instanceTemplates().get(
                 project=project, instanceTemplate=template_name
             )
-        ).get("properties")
-        template = NSDict(template)
+        )
+        template = NSDict(resp.get("properties"))
         # name and link are not in properties, so stick them in
         template.name = template_name
         template.link = template_link
@@ -1846,19 +3026,82 @@ class Lookup:
             template.gpu_type = None
             template.gpu_count = 0
 
-        # keep write access open for minimum time
-        with self.template_cache(writeback=True) as cache:
-            cache[template_name] = template.to_dict()
-        # cache should be owned by slurm
-        chown_slurm(self.template_cache_path)
-
+        self.cache.set(
+            key, {"fingerprint": template_fingerprint(resp), "properties": template}
+        )
         return template
 
+    def validate_template_info_cache(self, project=None):
+        """drop cached templates that no longer match the template in GCP,
+        eg. a template deleted and recreated under the same name
+        """
+        project = project or self.project
+        prefix = self.template_cache_key("")
+        cached = {
+            key[len(prefix) :]: self.cache.get(key)
+            for key in self.cache.keys()
+            if key.startswith(prefix)
+        }
+        requests = {
+            link: self.compute.instanceTemplates().get(
+                project=project,
+                instanceTemplate=trim_self_link(link),
+                fields="id,creationTimestamp",
+            )
+            for link, entry in cached.items()
+            if entry is not None
+        }
+        done, failed = batch_execute(requests)
+        stale = [
+            link
+            for link, resp in done.items()
+            if template_fingerprint(resp) != cached[link]["fingerprint"]
+        ]
+        stale.extend(
+            link
+            for link, (_, exc) in failed.items()
+            if getattr(exc, "status_code", None) == 404
+        )
+        if stale:
+            log.info(f"dropping changed templates from cache: {', '.join(stale)}")
+            self.cache.remove(map(self.template_cache_key, stale))
+            self.template_info.cache_clear()
+
     def clear_template_info_cache(self):
-        with self.template_cache(writeback=True) as cache:
-            cache.clear()
+        prefix = self.template_cache_key("")
+        self.cache.remove(k for k in self.cache.keys() if k.startswith(prefix))
         self.template_info.cache_clear()
 
+    def nodeset_warm_pool(self, nodeset_name):
+        """warm pool settings of a nodeset, None if it does not pool instances"""
+        nodeset = self.cfg.nodeset.get(nodeset_name)
+        # placement groups are per job, pooled instances would be stuck in one
+        if nodeset is None or not nodeset.warm_pool.size or nodeset.enable_placement:
+            return None
+        return nodeset.warm_pool
+
+    @staticmethod
+    def warm_pool_key(node):
+        return f"warm_pool:{node}"
+
+    def warm_pool(self):
+        """pooled nodes with the time their instance was stopped or suspended"""
+        prefix = self.warm_pool_key("")
+        pooled = (
+            (key[len(prefix) :], self.cache.get(key))
+            for key in self.cache.keys()
+            if key.startswith(prefix)
+        )
+        return {node: since for node, since in pooled if since is not None}
+
+    def pool_nodes(self, nodes):
+        now = time()
+        for node in nodes:
+            self.cache.set(self.warm_pool_key(node), now)
+
+    def unpool_nodes(self, nodes):
+        self.cache.remove(map(self.warm_pool_key, nodes))
+
     def nodeset_map(self, hostnames: list):
         """Convert a list of nodes into a map of nodeset_name to hostnames"""
         nodeset_map = collections.defaultdict(list)
@@ -1866,6 +3109,90 @@ class Lookup:
             nodeset_map[self.node_nodeset_name(node)].append(node)
         return nodeset_map
 
+    def placement_pool_name(self, index):
+        return f"{self.cfg.slurm_cluster_name}-pool-{index}"
+
+    @staticmethod
+    def placement_pool_key(region, name):
+        return f"placement_pool:{region}/{name}"
+
+    def placement_pool(self):
+        """(region, name) of the pooled placement policies: job id that
+        claimed it, None if free. Only policies that exist are recorded.
+        """
+        prefix = "placement_pool:"
+        pool = {}
+        for key in self.cache.keys():
+            if key.startswith(prefix):
+                entry = self.cache.get(key)
+                if entry is not None:
+                    region, _, name = key[len(prefix) :].partition("/")
+                    pool[(region, name)] = entry["job_id"]
+        return pool
+
+    def set_placement_pool(self, region, name, job_id=None, nodeset=None, index=None):
+        """record the job that claimed a pooled policy for its nodes of a
+        nodeset, as the index-th of its policies there, or free the policy
+        without a job_id
+        """
+        entry = {"job_id": job_id}
+        if job_id is not None:
+            entry.update(nodeset=nodeset, index=index)
+        self.cache.set(self.placement_pool_key(region, name), entry)
+
+    def claim_placement_policies(self, region, count, job_id, nodeset):
+        """pooled placement policies of region for the first count placement
+        groups of the nodes of job_id in nodeset, returns their names
+        The policies the job already holds for the nodeset come first, in the
+        order it claimed them, so that its nodes resumed over several calls
+        share them. Free policies are claimed for the rest.
+        """
+        if not self.cfg.placement_pool_size or not count:
+            return []
+        job_id = str(job_id)
+        prefix = self.placement_pool_key(region, "")
+        with self.cache.lock():
+            held = {}
+            free = []
+            for key in self.cache.keys():
+                if not key.startswith(prefix):
+                    continue
+                entry = self.cache.get(key)
+                if entry is None:
+                    continue
+                name = key[len(prefix) :]
+                if entry["job_id"] is None:
+                    free.append(name)
+                elif entry["job_id"] == job_id and entry.get("nodeset") == nodeset:
+                    held[name] = entry.get("index") or 0
+            names = sorted(held, key=lambda name: (held[name], name))[:count]
+            start = max(held.values(), default=-1) + 1
+            claimed = sorted(free)[: count - len(names)]
+            for index, name in enumerate(claimed, start):
+                self.set_placement_pool(region, name, job_id, nodeset, index)
+        return names + claimed
+
+    def zone_stockouts(self):
+        """zones that ran out of capacity within zone_stockout_ttl seconds:
+        nodes that failed to create there
+        """
+        ttl = self.cfg.zone_stockout_ttl
+        if not ttl:
+            return {}
+        prefix = "zone_stockout:"
+        stockouts = {}
+        for key in self.cache.keys():
+            if key.startswith(prefix):
+                entry = self.cache.get(key, max_age=ttl)
+                if entry is not None:
+                    stockouts[key[len(prefix) :]] = entry["nodes"]
+        return stockouts
+
+    def record_zone_stockouts(self, zone_nodes):
+        """record zone: nodes that failed to create for lack of capacity"""
+        for zone, count in zone_nodes.items():
+            self.cache.set(f"zone_stockout:{zone}", {"nodes": count})
+
 
 # Define late globals
 lkp = Lookup()
@@ -1880,6 +3207,24 @@ if not cfg:
 
 lkp = Lookup(cfg)
 
+
+@with_static(template_hits=0)
+def flush_metrics():
+    """write the metrics of this process, if enabled on the controller"""
+    hits = Lookup.template_info.cache_info().hits
+    if hits > flush_metrics.template_hits:
+        metrics.inc(
+            "slurm_gcp_template_info_total",
+            hits - flush_metrics.template_hits,
+            source="memory",
+        )
+    flush_metrics.template_hits = hits
+    if cfg.metrics_dir and lkp.instance_role_safe == "controller":
+        metrics.flush(cfg.metrics_dir)
+
+
+atexit.register(flush_metrics)
+
 if __name__ == "__main__":
     parser = argparse.ArgumentParser(
         description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter
@@ -0,0 +1,181 @@
+#!/usr/bin/env python3
+
+# Copyright (C) SchedMD LLC.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Resident worker for ResumeProgram and SuspendProgram
+
+The worker imports the slurm-gcp modules, loads config.yaml and builds the
+compute client once, then forks a pre-warmed child for every resume.py or
+suspend.py invocation forwarded to it over a unix socket. The scripts fall
+back to running in-process when the worker is not running.
+
+Only the standard library may be imported at module level, resume.py and
+suspend.py import this before anything else.
+"""
+
+import argparse
+import json
+import logging
+import os
+import signal
+import socket
+import sys
+from pathlib import Path
+
+filename = Path(__file__).name
+SOCKET_PATH = Path(__file__).parent / "worker.sock"
+COMMANDS = ("resume", "suspend")
+
+
+def _send(conn, msg):
+    conn.sendall(json.dumps(msg).encode() + b"\n")
+
+
+def forward(command, argv):
+    """hand a resume or suspend invocation to the worker
+    returns the exit code, or None if the worker did not take it
+    """
+    request = {"command": command, "argv": argv}
+    if command == "resume" and os.getenv("SLURM_RESUME_FILE"):
+        try:
+            request["resume_json"] = Path(os.environ["SLURM_RESUME_FILE"]).read_text()
+        except OSError:
+            return None
+    try:
+        conn = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        conn.settimeout(5)
+        conn.connect(str(SOCKET_PATH))
+        _send(conn, request)
+        conn.shutdown(socket.SHUT_WR)
+        stream = conn.makefile("r")
+        if not stream.readline():
+            # worker closed without accepting, eg. while restarting
+            return None
+    except OSError:
+        return None
+    # accepted, from here on the worker owns the request
+    conn.settimeout(None)
+    try:
+        reply = stream.readline()
+        return json.loads(reply)["exit"] if reply else 1
+    except (OSError, ValueError, KeyError):
+        return 1
+    finally:
+        conn.close()
+
+
+def forward_or_continue(command):
+    """exit with the worker's result if it handled this invocation"""
+    if os.getenv("SLURM_GCP_NO_WORKER"):
+        return
+    code = forward(command, sys.argv[1:])
+    if code is not None:
+        sys.exit(code)
+
+
+def handle(conn, modules):
+    """run one forwarded request, in a forked child"""
+    request = json.loads(conn.makefile("r").readline())
+    command = request["command"]
+    if command not in COMMANDS:
+        raise Exception(f"unknown command {command}")
+    _send(conn, {"accepted": True})
+    code = 0
+    try:
+        module = modules[command]
+        if command == "resume":
+            module.run_cli(request["argv"], resume_json=request.get("resume_json"))
+        else:
+            module.run_cli(request["argv"])
+    except SystemExit as e:
+        code = e.code if isinstance(e.code, int) else 1
+    except Exception:
+        modules["util"].handle_exception(*sys.exc_info())
+        code = 1
+    _send(conn, {"exit": code})
+
+
+def serve():
+    # the heavy imports, done once for every forked child
+    import util
+    import resume
+    import suspend
+
+    logfile = Path(util.cfg.slurm_log_dir or ".") / "worker.log"
+    util.chown_slurm(logfile, mode=0o600)
+    util.config_root_logger(
+        filename,
+        level=logging.DEBUG if util.cfg.enable_debug_logging else logging.INFO,
+        logfile=logfile,
+    )
+    log = logging.getLogger(filename)
+    modules = {"util": util, "resume": resume, "suspend": suspend}
+    lkp = util.lkp
+    config_stat = util.CONFIG_FILE.stat().st_mtime_ns
+
+    # warm up the compute client and the lookups every resume needs
+    for nodeset in lkp.cfg.nodeset.values():
+        try:
+            lkp.template_info(nodeset.instance_template)
+        except Exception as e:
+            log.warning(f"failed to warm template {nodeset.instance_template}: {e}")
+    # children would count the warm-up again if it was not flushed first
+    util.flush_metrics()
+
+    if SOCKET_PATH.exists():
+        SOCKET_PATH.unlink()
+    listener = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    listener.bind(str(SOCKET_PATH))
+    SOCKET_PATH.chmod(0o600)
+    listener.listen(128)
+    # children are not waited on, they report back over their connection
+    signal.signal(signal.SIGCHLD, signal.SIG_IGN)
+    log.info(f"worker listening on {SOCKET_PATH}")
+
+    while True:
+        conn, _ = listener.accept()
+        if util.CONFIG_FILE.stat().st_mtime_ns != config_stat:
+            # client falls back to in-process, systemd restarts the worker
+            log.info("config.yaml changed, restarting worker")
+            conn.close()
+            listener.close()
+            SOCKET_PATH.unlink()
+            return
+        if os.fork() == 0:
+            code = 0
+            try:
+                signal.signal(signal.SIGCHLD, signal.SIG_DFL)
+                listener.close()
+                # these may change without a config change
+                lkp.reservation.cache_clear()
+                handle(conn, modules)
+            except Exception:
+                util.handle_exception(*sys.exc_info())
+                code = 1
+            finally:
+                conn.close()
+                # os._exit skips atexit
+                util.flush_metrics()
+                logging.shutdown()
+                os._exit(code)
+        conn.close()
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter
+    )
+    parser.parse_args()
+    serve()
@@ -104,6 +104,7 @@ module "slurm_files" {
   enable_devel                       = var.enable_devel
   enable_debug_logging               = var.enable_debug_logging
   extra_logging_flags                = var.extra_logging_flags
+  enable_structured_logging          = var.enable_structured_logging
   enable_hybrid                      = var.enable_hybrid
   enable_slurm_gcp_plugins           = var.enable_slurm_gcp_plugins
   enable_bigquery_load               = var.enable_bigquery_load
@@ -122,6 +123,12 @@ module "slurm_files" {
   slurmdbd_conf_tpl                  = var.slurmdbd_conf_tpl
   slurm_conf_tpl                     = var.slurm_conf_tpl
   slurm_cluster_name                 = var.slurm_cluster_name
+  config_rollout_window              = var.config_rollout_window
+  metrics_dir                        = var.metrics_dir
+  placement_pool_size                = var.placement_pool_size
+  zone_stockout_ttl                  = var.zone_stockout_ttl
+  slurmsync_daemon                   = var.slurmsync_daemon
+  suspend_coalesce_window            = var.suspend_coalesce_window
   # hybrid
   google_app_cred_path    = lookup(var.controller_hybrid_config, "google_app_cred_path", null)
   slurm_control_host      = lookup(var.controller_hybrid_config, "slurm_control_host", null)
@@ -208,6 +215,7 @@ module "slurm_nodeset" {
   instance_template_self_link = module.slurm_nodeset_template[each.key].self_link
   reservation_name            = each.value.reservation_name
   subnetwork_self_link        = data.google_compute_subnetwork.nodeset_subnetwork[each.key].self_link
+  warm_pool                   = each.value.warm_pool
   zones                       = each.value.zones
   zone_target_shape           = each.value.zone_target_shape
 }
@@ -41,15 +41,22 @@ resource "random_uuid" "cluster_id" {
 
 locals {
   config = {
-    enable_slurm_gcp_plugins = var.enable_slurm_gcp_plugins
-    enable_bigquery_load     = var.enable_bigquery_load
-    cloudsql_secret          = var.cloudsql_secret
-    cluster_id               = random_uuid.cluster_id.result
-    project                  = var.project_id
-    slurm_cluster_name       = var.slurm_cluster_name
-    bucket_path              = local.bucket_path
-    enable_debug_logging     = var.enable_debug_logging
-    extra_logging_flags      = var.extra_logging_flags
+    enable_slurm_gcp_plugins  = var.enable_slurm_gcp_plugins
+    enable_bigquery_load      = var.enable_bigquery_load
+    cloudsql_secret           = var.cloudsql_secret
+    cluster_id                = random_uuid.cluster_id.result
+    project                   = var.project_id
+    slurm_cluster_name        = var.slurm_cluster_name
+    bucket_path               = local.bucket_path
+    enable_debug_logging      = var.enable_debug_logging
+    extra_logging_flags       = var.extra_logging_flags
+    enable_structured_logging = var.enable_structured_logging
+    suspend_coalesce_window   = var.suspend_coalesce_window
+    config_rollout_window     = var.config_rollout_window
+    metrics_dir               = var.metrics_dir
+    placement_pool_size       = var.placement_pool_size
+    zone_stockout_ttl         = var.zone_stockout_ttl
+    slurmsync_daemon          = var.slurmsync_daemon
 
     # storage
     disable_default_mounts = var.disable_default_mounts
@@ -124,6 +131,15 @@ resource "google_storage_bucket_object" "config" {
   content = yamlencode(local.config)
 }
 
+# nodes watch this instead of polling config.yaml in the bucket
+resource "google_compute_project_metadata_item" "config_version" {
+  count = var.enable_hybrid ? 0 : 1
+
+  project = var.project_id
+  key     = "${var.slurm_cluster_name}-config-version"
+  value   = google_storage_bucket_object.config.md5hash
+}
+
 #########
 # DEVEL #
 #########
@@ -149,6 +165,10 @@ data "archive_file" "slurm_gcp_devel_zip" {
     fileset(local.scripts_dir, "*.log"),
     fileset(local.scripts_dir, "*.cache"),
     fileset(local.scripts_dir, "*.lock"),
+    fileset(local.scripts_dir, "*.sock"),
+    fileset(local.scripts_dir, "lookup_cache/*"),
+    fileset(local.scripts_dir, "suspend_spool/*"),
+    fileset(local.scripts_dir, "boot_timing/*"),
   ])
 }
 
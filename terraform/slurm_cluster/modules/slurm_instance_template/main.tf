@@ -146,11 +146,12 @@ module "instance_template" {
   metadata = merge(
     var.metadata,
     {
-      enable-oslogin      = upper(var.enable_oslogin)
-      slurm_bucket_path   = var.slurm_bucket_path
-      slurm_cluster_name  = var.slurm_cluster_name
-      slurm_instance_role = local.slurm_instance_role
-      VmDnsSetting        = "GlobalOnly"
+      enable-guest-attributes = "TRUE"
+      enable-oslogin          = upper(var.enable_oslogin)
+      slurm_bucket_path       = var.slurm_bucket_path
+      slurm_cluster_name      = var.slurm_cluster_name
+      slurm_instance_role     = local.slurm_instance_role
+      VmDnsSetting            = "GlobalOnly"
     },
   )
 
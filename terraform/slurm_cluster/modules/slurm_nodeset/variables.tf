@@ -126,6 +126,26 @@ variable "enable_placement" {
   default     = false
 }
 
+variable "warm_pool" {
+  description = <<-EOD
+    Keep up to 'size' idle dynamic nodes stopped (mode = "stop") or suspended
+    (mode = "suspend") instead of deleting them, and start or resume them when
+    Slurm powers them up again. Pooled instances are deleted after 'ttl' seconds.
+    Ignored when enable_placement is true.
+  EOD
+  type = object({
+    size = optional(number, 0)
+    ttl  = optional(number, 3600)
+    mode = optional(string, "stop")
+  })
+  default = {}
+
+  validation {
+    condition     = contains(["stop", "suspend"], var.warm_pool.mode)
+    error_message = "Allowed values for warm_pool.mode are 'stop' or 'suspend'."
+  }
+}
+
 variable "enable_public_ip" {
   description = "Enables IP address to access the Internet."
   type        = bool
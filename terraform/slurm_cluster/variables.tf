@@ -304,8 +304,13 @@ variable "nodeset" {
     spot                 = optional(bool, false)
     tags                 = optional(list(string), [])
     termination_action   = optional(string)
-    zones                = optional(list(string), [])
-    zone_target_shape    = optional(string, "ANY_SINGLE_ZONE")
+    warm_pool = optional(object({
+      size = optional(number, 0)
+      ttl  = optional(number, 3600)
+      mode = optional(string, "stop")
+    }), {})
+    zones             = optional(list(string), [])
+    zone_target_shape = optional(string, "ANY_SINGLE_ZONE")
   }))
   default = []
 
@@ -420,6 +425,16 @@ variable "extra_logging_flags" {
   default     = {}
 }
 
+variable "enable_structured_logging" {
+  description = <<EOD
+Write the logs of the slurm-gcp scripts as JSON lines from a background thread.
+Debug records are kept in memory and written ahead of the next error, also
+without enable_debug_logging.
+EOD
+  type        = bool
+  default     = false
+}
+
 variable "enable_cleanup_compute" {
   description = <<EOD
 Enables automatic cleanup of compute nodes and resource policies (e.g.
@@ -464,6 +479,85 @@ variable "cloud_parameters" {
   default = {}
 }
 
+variable "config_rollout_window" {
+  description = <<EOD
+Seconds over which compute and login nodes spread picking up a change of
+config.yaml, each at a random delay. Set to 0 to apply changes everywhere at
+once.
+EOD
+  type        = number
+  default     = 120
+
+  validation {
+    condition     = var.config_rollout_window >= 0
+    error_message = "Variable 'config_rollout_window' must be >= 0."
+  }
+}
+
+variable "placement_pool_size" {
+  description = <<EOD
+Placement policies kept created per region of the nodesets with
+enable_placement, for jobs to claim at resume instead of creating their own.
+Set to 0 to create the placement policies of every job at resume.
+EOD
+  type        = number
+  default     = 0
+
+  validation {
+    condition     = var.placement_pool_size >= 0
+    error_message = "Variable 'placement_pool_size' must be >= 0."
+  }
+}
+
+variable "metrics_dir" {
+  description = <<EOD
+Directory on the controller for the Prometheus metrics of the slurm-gcp
+scripts, as read by the node_exporter textfile collector. The metrics are
+written to slurm_gcp.prom. Set to null to disable.
+EOD
+  type        = string
+  default     = null
+}
+
+variable "suspend_coalesce_window" {
+  description = <<EOD
+Seconds SuspendProgram waits to merge concurrent suspend calls into shared
+delete batches. Set to 0 to delete the nodes of every call immediately.
+EOD
+  type        = number
+  default     = 0
+
+  validation {
+    condition     = var.suspend_coalesce_window >= 0
+    error_message = "Variable 'suspend_coalesce_window' must be >= 0."
+  }
+}
+
+variable "slurmsync_daemon" {
+  description = <<EOD
+Run slurmsync.py on the controller as the persistent slurmsync.service daemon,
+which only reconciles changed nodes between full resyncs, instead of from
+slurmcmd.timer.
+EOD
+  type        = bool
+  default     = false
+}
+
+variable "zone_stockout_ttl" {
+  description = <<EOD
+Seconds a zone is avoided by resume after it ran out of capacity for new
+instances. Nodes without a placement group that fail for lack of capacity are
+retried in the other allowed zones in the same resume. Set to 0 to disable.
+EOD
+  type        = number
+  default     = 0
+
+  validation {
+    condition     = var.zone_stockout_ttl >= 0
+    error_message = "Variable 'zone_stockout_ttl' must be >= 0."
+  }
+}
+
 variable "disable_default_mounts" {
   description = <<-EOD
     Disable default global network storage from the controller
@@ -0,0 +1,400 @@
+#!/usr/bin/env python3
+
+# Copyright (C) SchedMD LLC.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Benchmark the controller scripts at scale against fake APIs
+
+Each scenario runs in its own process, against the in-process fake Compute
+and TPU APIs of fakes.py and the fake scontrol of fake_slurm.py:
+
+  resume   resume.main() of every node, with no instances yet
+  suspend  suspend.main() of every node, all with running instances
+  sync     slurmsync.sync_slurm() of nodes in a mix of states
+  tpu      resume.main() of single vm TPU nodes, if google-cloud-tpu is installed
+
+Wall time, API calls, subprocesses and peak memory are reported for each
+scenario and cluster size. With --baseline, a run fails if it makes more API
+calls or subprocesses than the baseline or is more than --max-slowdown times
+slower.
+"""
+
+import argparse
+import json
+import os
+import resource
+import subprocess
+import sys
+import tempfile
+from pathlib import Path
+from shutil import rmtree
+from time import perf_counter
+
+import yaml
+
+import fakes
+
+BENCH_DIR = Path(__file__).resolve().parent
+SCRIPTS_DIR = BENCH_DIR.parent.parent / "scripts"
+SCENARIOS = ("resume", "suspend", "sync", "tpu")
+CLUSTER = "bench"
+PROJECT = "bench-project"
+REGION = "us-central1"
+ZONES = ("us-central1-a", "us-central1-b", "us-central1-c")
+TEMPLATE = "bench-compute"
+# compared exactly to the baseline, the rest of the results are informational
+COUNTED = ("api_calls", "subprocesses")
+
+
+def cluster_config(scenario, nodes, workdir):
+    project_link = f"{fakes.BASE_URL}/projects/{PROJECT}"
+    nodeset = {
+        "nodeset_name": "n1",
+        "node_count_static": 0,
+        "node_count_dynamic_max": nodes,
+        "instance_template": f"{project_link}/global/instanceTemplates/{TEMPLATE}",
+        "subnetwork": f"{project_link}/regions/{REGION}/subnetworks/s",
+        "zone_policy_allow": list(ZONES),
+        "zone_policy_deny": [],
+        "warm_pool": {"size": 0},
+    }
+    nodeset_tpu = {
+        "nodeset_name": "tpu",
+        "node_count_static": 0,
+        "node_count_dynamic_max": nodes,
+        "zone": ZONES[0],
+        "node_type": "v2-8",
+        "tf_version": "2.14.0",
+        "accelerator_config": {"topology": "2x2", "version": "V2"},
+        "preserve_tpu": False,
+        "data_disks": [],
+    }
+    tpu = scenario == "tpu"
+    return {
+        "slurm_cluster_name": CLUSTER,
+        "project": PROJECT,
+        "slurm_bin_dir": str(workdir / "bin"),
+        "slurm_log_dir": str(workdir / "log"),
+        "enable_slurm_gcp_plugins": False,
+        "nodeset": {} if tpu else {"n1": nodeset},
+        "nodeset_tpu": {"tpu": nodeset_tpu} if tpu else {},
+        "nodeset_dyn": {},
+        "partitions": {
+            "p1": {
+                "partition_name": "p1",
+                "partition_nodeset": [] if tpu else ["n1"],
+                "partition_nodeset_tpu": ["tpu"] if tpu else [],
+                "enable_job_exclusive": False,
+            }
+        },
+    }
+
+
+def node_names(scenario, nodes):
+    nodeset = "tpu" if scenario == "tpu" else "n1"
+    return [f"{CLUSTER}-{nodeset}-{i}" for i in range(nodes)]
+
+
+def initial_state(scenario, names, cloud):
+    """slurm node states, and instances in the fake cloud"""
+    slurm = {}
+    for i, name in enumerate(names):
+        zone = ZONES[i % len(ZONES)]
+        if scenario in ("resume", "tpu"):
+            slurm[name] = ["IDLE", "CLOUD", "POWERING_UP"]
+        elif scenario == "suspend":
+            slurm[name] = ["IDLE", "CLOUD", "POWERING_DOWN"]
+            cloud.add_instance(name, zone)
+        elif i % 20 == 0:
+            # up in slurm without an instance, unbacked
+            slurm[name] = ["IDLE", "CLOUD"]
+        elif i % 20 == 1:
+            # powered down with a running instance, orphan
+            slurm[name] = ["IDLE", "CLOUD", "POWERED_DOWN"]
+            cloud.add_instance(name, zone)
+        elif i % 20 == 2:
+            # up in slurm with a stopped instance, terminated
+            slurm[name] = ["IDLE", "CLOUD"]
+            cloud.add_instance(name, zone, status="TERMINATED")
+        elif i % 2:
+            slurm[name] = ["IDLE", "CLOUD", "POWERED_DOWN"]
+        else:
+            slurm[name] = ["ALLOCATED", "CLOUD"]
+            cloud.add_instance(name, zone)
+    return {"nodes": slurm}
+
+
+class CountingPopen(subprocess.Popen):
+    count = 0
+
+    def __init__(self, *args, **kwargs):
+        CountingPopen.count += 1
+        super().__init__(*args, **kwargs)
+
+
+def max_rss_mb():
+    return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss / 1024
+
+
+def run_scenario(args):
+    """run one scenario in this process, returns its results"""
+    workdir = Path(tempfile.mkdtemp(prefix="slurm-gcp-bench-"))
+    bindir = workdir / "bin"
+    bindir.mkdir()
+    for command in ("scontrol", "sinfo", "squeue"):
+        (bindir / command).symlink_to(BENCH_DIR / "fake_slurm.py")
+    config_file = workdir / "config.yaml"
+    config_file.write_text(
+        yaml.safe_dump(cluster_config(args.scenario, args.nodes, workdir))
+    )
+    os.environ["SLURM_CONFIG_YAML"] = str(config_file)
+    os.environ["FAKE_SLURM_STATE"] = str(workdir / "slurm_state.json")
+    os.environ["SLURM_GCP_NO_WORKER"] = "1"
+
+    cloud = fakes.FakeCloud(
+        PROJECT,
+        REGION,
+        ZONES,
+        latency=args.latency,
+        op_duration=args.op_duration,
+        quota_error_rate=args.quota_error_rate,
+        bulk_failure_rate=args.bulk_failure_rate,
+        seed=args.seed,
+    )
+    cloud.add_template(TEMPLATE)
+    fakes.install(cloud)
+    names = node_names(args.scenario, args.nodes)
+    state = initial_state(args.scenario, names, cloud)
+    (workdir / "slurm_state.json").write_text(json.dumps(state))
+
+    sys.path.insert(0, str(SCRIPTS_DIR))
+    subprocess.Popen = CountingPopen
+    import util
+
+    util.config_root_logger(
+        "bench", level=args.log_level, stdout=False, logfile=workdir / "bench.log"
+    )
+    util.instance_metadata = lambda path: (
+        "controller" if path == "attributes/slurm_instance_role" else ""
+    )
+    # a private limiter, not the one shared with the scripts on this host
+    rate = args.api_rate or 1e9
+
+    def rate_limiter(api="compute", limiters={}):
+        if api not in limiters:
+            limiters[api] = util.RateLimiter(f"bench-{api}", rate, rate * 100)
+            if limiters[api]._fd is not None:
+                os.close(limiters[api]._fd)
+                limiters[api]._fd = None
+        return limiters[api]
+
+    util.rate_limiter = rate_limiter
+    util.lkp.cache = util.FileCache(workdir / "lookup_cache")
+    util.lkp.boot_timing = util.FileCache(workdir / "boot_timing")
+    if args.scenario == "tpu" and not util.can_tpu:
+        rmtree(workdir)
+        return {"skipped": "google-cloud-tpu is not installed"}
+
+    import resume
+    import slurmsync
+    import suspend
+
+    suspend.SPOOL_DIR = workdir / "suspend_spool"
+    hostlist = util.to_hostlist(names)
+    run = {
+        "resume": lambda: resume.main(hostlist),
+        "suspend": lambda: suspend.main(hostlist),
+        "sync": lambda: slurmsync.sync_slurm(),
+        "tpu": lambda: resume.main(hostlist),
+    }[args.scenario]
+
+    cloud.reset_counts()
+    CountingPopen.count = 0
+    rss_before = max_rss_mb()
+    start = perf_counter()
+    run()
+    wall = perf_counter() - start
+    results = {
+        "wall_seconds": round(wall, 3),
+        "api_calls": sum(cloud.calls.values()),
+        "http_calls": cloud.http_calls,
+        "quota_errors": cloud.quota_errors,
+        "subprocesses": CountingPopen.count,
+        "peak_rss_mb": round(max_rss_mb(), 1),
+        "rss_growth_mb": round(max_rss_mb() - rss_before, 1),
+        "instances_after": len(cloud.instances) + len(cloud.tpu_nodes),
+        "api_calls_by_method": dict(sorted(cloud.calls.items())),
+    }
+    if args.keep:
+        results["workdir"] = str(workdir)
+    else:
+        rmtree(workdir)
+    return results
+
+
+def run_child(scenario, nodes, args):
+    """run a scenario in a fresh process, so memory and caches start clean"""
+    with tempfile.NamedTemporaryFile(suffix=".json") as result:
+        cmd = [
+            sys.executable,
+            __file__,
+            "--scenario",
+            scenario,
+            "--nodes",
+            str(nodes),
+            "--result",
+            result.name,
+            "--latency",
+            str(args.latency),
+            "--op-duration",
+            str(args.op_duration),
+            "--quota-error-rate",
+            str(args.quota_error_rate),
+            "--bulk-failure-rate",
+            str(args.bulk_failure_rate),
+            "--api-rate",
+            str(args.api_rate),
+            "--seed",
+            str(args.seed),
+            "--log-level",
+            args.log_level,
+        ]
+        if args.keep:
+            cmd.append("--keep")
+        proc = subprocess.run(cmd, capture_output=True, text=True)
+        if proc.returncode != 0:
+            return {"error": proc.stderr.strip().splitlines()[-1:]}
+        return json.loads(Path(result.name).read_text())
+
+
+def regressions(results, baseline, max_slowdown):
+    """descriptions of the results that are worse than the baseline"""
+    found = []
+    for key, result in results.items():
+        base = baseline.get(key)
+        if base is None or "wall_seconds" not in result or "wall_seconds" not in base:
+            continue
+        for counted in COUNTED:
+            if result[counted] > base[counted]:
+                found.append(f"{key}: {counted} {base[counted]} -> {result[counted]}")
+        wall, base_wall = result["wall_seconds"], base["wall_seconds"]
+        if wall > base_wall * max_slowdown:
+            found.append(f"{key}: wall_seconds {base_wall} -> {wall}")
+    return found
+
+
+def print_table(results):
+    header = ("scenario", "nodes", "wall(s)", "api", "http", "subproc", "rss(MB)")
+    print("".join(f"{h:>12}" for h in header))
+    for key, result in results.items():
+        scenario, nodes = key.split(":")
+        if "wall_seconds" not in result:
+            print(f"{scenario:>12}{nodes:>12}  {result}")
+            continue
+        row = (
+            result["wall_seconds"],
+            result["api_calls"],
+            result["http_calls"],
+            result["subprocesses"],
+            result["peak_rss_mb"],
+        )
+        print(f"{scenario:>12}{nodes:>12}" + "".join(f"{v:>12}" for v in row))
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter
+    )
+    parser.add_argument(
+        "--sizes", default="1000,10000", help="comma separated node counts"
+    )
+    parser.add_argument(
+        "--scenarios",
+        default=",".join(SCENARIOS),
+        help="comma separated scenarios to run",
+    )
+    parser.add_argument(
+        "--latency", type=float, default=0.0, help="seconds per api call"
+    )
+    parser.add_argument(
+        "--op-duration",
+        type=float,
+        default=0.0,
+        help="seconds until an operation is done",
+    )
+    parser.add_argument(
+        "--quota-error-rate",
+        type=float,
+        default=0.0,
+        help="chance of a rate limit error per request",
+    )
+    parser.add_argument(
+        "--bulk-failure-rate",
+        type=float,
+        default=0.0,
+        help="chance of each bulkInsert instance failing to create",
+    )
+    parser.add_argument(
+        "--api-rate",
+        type=float,
+        default=0,
+        help="compute api requests per second allowed, 0 for no pacing",
+    )
+    parser.add_argument("--seed", type=int, default=0)
+    parser.add_argument(
+        "--log-level", default="WARNING", help="log level of the scripts"
+    )
+    parser.add_argument("--output", help="write the results to this json file")
+    parser.add_argument("--baseline", help="json results to check for regressions")
+    parser.add_argument(
+        "--max-slowdown",
+        type=float,
+        default=1.5,
+        help="wall time ratio to the baseline that counts as a regression",
+    )
+    parser.add_argument(
+        "--keep", action="store_true", help="keep the work directory of each run"
+    )
+    # a single scenario, run in a child process
+    parser.add_argument("--scenario", choices=SCENARIOS, help=argparse.SUPPRESS)
+    parser.add_argument("--nodes", type=int, help=argparse.SUPPRESS)
+    parser.add_argument("--result", help=argparse.SUPPRESS)
+    args = parser.parse_args()
+
+    if args.scenario:
+        results = run_scenario(args)
+        Path(args.result).write_text(json.dumps(results))
+        return
+
+    results = {}
+    for scenario in args.scenarios.split(","):
+        for nodes in map(int, args.sizes.split(",")):
+            results[f"{scenario}:{nodes}"] = run_child(scenario, nodes, args)
+    print_table(results)
+    if args.output:
+        Path(args.output).write_text(json.dumps(results, indent=2) + "\n")
+    if args.baseline:
+        found = regressions(
+            results, json.loads(Path(args.baseline).read_text()), args.max_slowdown
+        )
+        for regression in found:
+            print(f"REGRESSION {regression}")
+        if found:
+            sys.exit(1)
+    if any("error" in result for result in results.values()):
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
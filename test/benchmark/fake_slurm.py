@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+
+# Copyright (C) SchedMD LLC.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Fake scontrol, sinfo and squeue for the benchmarks
+
+Installed as symlinks named after the command. Node states are kept in the
+json file named by FAKE_SLURM_STATE, as {"nodes": {name: [state, flags...]}}.
+Only the commands the slurm-gcp scripts run are handled, others succeed
+without output.
+"""
+
+import fcntl
+import json
+import os
+import re
+import sys
+from contextlib import contextmanager
+from pathlib import Path
+
+STATE_FILE = Path(os.environ.get("FAKE_SLURM_STATE", "slurm_state.json"))
+
+
+@contextmanager
+def state(write=False):
+    with open(STATE_FILE, "r+" if write else "r") as f:
+        fcntl.lockf(f, fcntl.LOCK_EX if write else fcntl.LOCK_SH)
+        data = json.load(f)
+        yield data
+        if write:
+            f.seek(0)
+            f.truncate()
+            json.dump(data, f)
+
+
+def expand(hostlist):
+    """hostnames of a hostlist like a-[0-3,7],b-1"""
+    names = []
+    for expr in re.findall(r"[^,\[]+(?:\[[^\]]*\])?", hostlist):
+        m = re.fullmatch(r"(.*)\[(.*)\]", expr)
+        if m is None:
+            names.append(expr)
+            continue
+        for part in m[2].split(","):
+            lo, _, hi = part.partition("-")
+            width = len(lo)
+            indices = range(int(lo), int(hi or lo) + 1)
+            names.extend(f"{m[1]}{i:0{width}d}" for i in indices)
+    return names
+
+
+def update_nodes(names, params):
+    new_state = params.get("state", "").upper()
+    with state(write=True) as data:
+        for name in names:
+            states = data["nodes"].get(name)
+            if states is None:
+                continue
+            base, flags = states[0], set(states[1:])
+            if new_state == "DOWN":
+                base = "DOWN"
+            elif new_state in ("RESUME", "IDLE"):
+                base = "IDLE"
+                flags -= {"DRAIN", "FAIL", "POWERING_DOWN"}
+            elif new_state == "POWER_UP":
+                flags -= {"POWERED_DOWN"}
+                flags.add("POWERING_UP")
+            elif new_state in ("POWER_DOWN", "POWER_DOWN_FORCE"):
+                flags -= {"POWERING_UP"}
+                flags.add("POWERING_DOWN")
+            data["nodes"][name] = [base, *sorted(flags)]
+
+
+def show_nodes(args, as_json):
+    with state() as data:
+        nodes = data["nodes"]
+        names = expand(args[0]) if args else list(nodes)
+        found = [(name, nodes[name]) for name in names if name in nodes]
+    if as_json:
+        print(json.dumps({"nodes": [{"name": n, "state": s} for n, s in found]}))
+        return
+    for name, states in found:
+        print(f"NodeName={name} Arch=x86_64 State={'+'.join(states)} Partitions=p")
+
+
+def scontrol(argv):
+    as_json = "--json" in argv
+    args = [a for a in argv if not a.startswith("--")]
+    if args[:1] == ["update"]:
+        params = dict(a.split("=", 1) for a in args[1:] if "=" in a)
+        if "nodename" in params:
+            update_nodes(expand(params["nodename"]), params)
+    elif args[:2] == ["show", "nodes"]:
+        show_nodes(args[2:], as_json)
+    elif args[:2] == ["show", "jobs"]:
+        print(json.dumps({"jobs": []}))
+    elif args[:2] == ["show", "config"]:
+        print("SuspendExcStates        = (null)")
+    elif args[:2] == ["show", "hostnames"]:
+        print("\n".join(expand(args[2])))
+    elif args[:2] == ["show", "hostlist"]:
+        print(",".join(Path(args[2]).read_text().split()))
+
+
+def main():
+    command = Path(sys.argv[0]).name
+    if command == "scontrol":
+        scontrol(sys.argv[1:])
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,608 @@
+# Copyright (C) SchedMD LLC.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""In-process fakes of the Compute and TPU APIs for the benchmarks
+
+FakeCloud holds the instances, operations and templates of a fake project.
+FakeCompute stands in for the discovery client the scripts build, returning
+requests with execute() and batches like googleapiclient does. install()
+points googleapiclient, google.auth and the TPU client at the fakes, it must
+be called before util is imported.
+
+Only what resume.py, suspend.py and slurmsync.py use is implemented. List
+filters are ignored except for operationGroupId, fields only narrow the top
+level keys of listed items.
+"""
+
+import json
+import random
+import re
+import threading
+from collections import Counter
+from datetime import datetime, timezone
+from itertools import count
+from time import monotonic, sleep, time
+from types import SimpleNamespace
+
+BASE_URL = "https://www.googleapis.com/compute/v1"
+PAGE_SIZE = 500
+# longest a zoneOperations.wait blocks, like the real api
+WAIT_TIMEOUT = 120
+
+
+def timestamp(when=None):
+    """RFC 3339 timestamp, like the api returns"""
+    when = datetime.fromtimestamp(when or time(), tz=timezone.utc)
+    return when.isoformat(timespec="milliseconds")
+
+
+class FakeResponse(dict):
+    """http response headers with status and reason, for HttpError"""
+
+    def __init__(self, status, reason):
+        super().__init__(status=str(status))
+        self.status = status
+        self.reason = reason
+
+
+def http_error(status, reason, message):
+    from googleapiclient.errors import HttpError
+
+    content = {
+        "error": {
+            "code": status,
+            "message": message,
+            "errors": [{"message": message, "reason": reason}],
+        }
+    }
+    return HttpError(FakeResponse(status, reason), json.dumps(content).encode())
+
+
+def project_fields(items, fields):
+    """narrow items to the top level keys in the last (...) group of fields"""
+    m = re.search(r"\(([^()]*)\)[^()]*$", fields or "")
+    if m is None:
+        return items
+    keys = {f.split("/")[0] for f in m[1].split(",")}
+    return [{k: v for k, v in item.items() if k in keys} for item in items]
+
+
+class FakeCloud:
+    """State of a fake GCP project, and the knobs of how its api behaves
+    latency is the seconds each api call or batch takes, op_duration the
+    seconds until an operation is done. quota_error_rate is the chance any
+    request fails with a rate limit error, bulk_failure_rate the chance each
+    instance of a bulkInsert fails to be created.
+    """
+
+    def __init__(
+        self,
+        project,
+        region,
+        zones,
+        latency=0.0,
+        op_duration=0.0,
+        quota_error_rate=0.0,
+        bulk_failure_rate=0.0,
+        seed=0,
+    ):
+        self.project = project
+        self.region = region
+        self.zones = list(zones)
+        self.latency = latency
+        self.op_duration = op_duration
+        self.quota_error_rate = quota_error_rate
+        self.bulk_failure_rate = bulk_failure_rate
+        self.random = random.Random(seed)
+        self.lock = threading.RLock()
+        self.instances = {}
+        self.operations = {}
+        self.templates = {}
+        self.machine_types = {}
+        self.tpu_nodes = {}
+        # api requests by method id, batches count as one http call each
+        self.calls = Counter()
+        self.http_calls = 0
+        self.quota_errors = 0
+        self._ids = count(1)
+
+    def link(self, *parts):
+        return "/".join((BASE_URL, "projects", self.project, *parts))
+
+    def reset_counts(self):
+        with self.lock:
+            self.calls.clear()
+            self.http_calls = 0
+            self.quota_errors = 0
+
+    # state setup
+
+    def add_template(self, name, machine_type="n2-standard-4", disks=None):
+        self.templates[name] = {
+            "name": name,
+            "id": str(next(self._ids)),
+            "creationTimestamp": timestamp(),
+            "selfLink": self.link("global/instanceTemplates", name),
+            "properties": {
+                "machineType": machine_type,
+                "metadata": {"items": []},
+                "labels": {},
+                "disks": disks
+                or [
+                    {
+                        "boot": True,
+                        "initializeParams": {"diskType": "pd-standard"},
+                    }
+                ],
+                "scheduling": {"preemptible": False},
+            },
+        }
+        self.machine_types.setdefault(
+            machine_type, {"guestCpus": 4, "memoryMb": 16384}
+        )
+
+    def add_instance(self, name, zone, status="RUNNING", labels=None):
+        self.instances[name] = {
+            "name": name,
+            "id": str(next(self._ids)),
+            "zone": self.link("zones", zone),
+            "selfLink": self.link("zones", zone, "instances", name),
+            "status": status,
+            "creationTimestamp": timestamp(),
+            "lastStartTimestamp": timestamp(),
+            "machineType": self.link("zones", zone, "machineTypes/n2-standard-4"),
+            "labels": {"slurm_instance_role": "compute", **(labels or {})},
+            "scheduling": {"preemptible": False},
+            "networkInterfaces": [{"networkIP": "127.0.0.1"}],
+        }
+
+    # call handling
+
+    def call(self, method, handler, kwargs, in_batch=False):
+        """run one request, batched requests share the latency of the batch"""
+        with self.lock:
+            self.calls[method] += 1
+            if not in_batch:
+                self.http_calls += 1
+            quota_error = self.random.random() < self.quota_error_rate
+            if quota_error:
+                self.quota_errors += 1
+        if not in_batch and self.latency:
+            sleep(self.latency)
+        if quota_error:
+            raise http_error(403, "rateLimitExceeded", "Rate Limit Exceeded")
+        if method.endswith(".wait"):
+            # waits block outside the lock, until their operation is done
+            return handler(**kwargs)
+        with self.lock:
+            return handler(**kwargs)
+
+    def execute_batch(self, requests):
+        """run the requests of a batch as one http call
+        returns (request_id, response, exception) for each
+        """
+        with self.lock:
+            self.http_calls += 1
+        # operations waited on in a batch are waited on in parallel
+        delay = max((req.wait_remaining() for _, req in requests), default=0)
+        sleep(max(self.latency, min(delay, WAIT_TIMEOUT)))
+        results = []
+        for rid, req in requests:
+            try:
+                results.append((rid, req.execute(in_batch=True), None))
+            except Exception as e:
+                results.append((rid, None, e))
+        return results
+
+    def new_operation(self, op_type, target, location, group_id=None, error=None):
+        now = time()
+        op = {
+            "kind": "compute#operation",
+            "id": str(next(self._ids)),
+            "name": f"operation-{next(self._ids)}",
+            "operationType": op_type,
+            "targetLink": target,
+            "status": "DONE" if not self.op_duration else "RUNNING",
+            "insertTime": timestamp(now),
+            "startTime": timestamp(now),
+            "selfLink": "",
+            "_done_at": now + self.op_duration,
+        }
+        # zones/<zone> or regions/<region>, as zone or region
+        kind = location.split("/")[0]
+        op[kind[:-1]] = self.link(location)
+        op["selfLink"] = self.link(location, "operations", op["name"])
+        if group_id is not None:
+            op["operationGroupId"] = group_id
+        if error is not None:
+            op["error"] = {"errors": [error]}
+        if not self.op_duration:
+            op["endTime"] = op["insertTime"]
+        with self.lock:
+            self.operations[op["name"]] = op
+        return op
+
+    def wait_operation(self, name):
+        op = self.operations.get(name)
+        if op is not None:
+            sleep(min(max(op["_done_at"] - time(), 0), WAIT_TIMEOUT))
+        return self.operation(name)
+
+    def operation(self, name):
+        op = self.operations.get(name)
+        if op is None:
+            raise http_error(404, "notFound", f"operation {name} not found")
+        if op["status"] != "DONE" and time() >= op["_done_at"]:
+            op["status"] = "DONE"
+            op["endTime"] = timestamp(op["_done_at"])
+        return {k: v for k, v in op.items() if k[0] != "_"}
+
+    def instance(self, name):
+        inst = self.instances.get(name)
+        if inst is None:
+            raise http_error(404, "notFound", f"instance {name} not found")
+        return inst
+
+    # compute api methods, named resource_method
+
+    def regionInstances_bulkInsert(self, project, region, body):
+        template = body["sourceInstanceTemplate"].split("/")[-1]
+        if template not in self.templates:
+            raise http_error(400, "invalid", f"template {template} not found")
+        names = list(body["perInstanceProperties"])
+        locations = body.get("locationPolicy", {}).get("locations", {})
+        zones = [
+            loc.split("/")[-1]
+            for loc, pref in locations.items()
+            if pref.get("preference") == "ALLOW"
+        ] or self.zones
+        zone = self.random.choice(zones)
+        group_id = f"group-{next(self._ids)}"
+        labels = body.get("instanceProperties", {}).get("labels")
+        for name in names:
+            target = self.link("zones", zone, "instances", name)
+            error = None
+            if self.random.random() < self.bulk_failure_rate:
+                error = {
+                    "code": "ZONE_RESOURCE_POOL_EXHAUSTED",
+                    "message": f"The zone {zone} does not have enough resources",
+                }
+            elif name in self.instances:
+                error = {
+                    "code": "RESOURCE_ALREADY_EXISTS",
+                    "message": f"The resource {name} already exists",
+                }
+            else:
+                self.add_instance(name, zone, labels=labels)
+            self.new_operation("insert", target, f"zones/{zone}", group_id, error)
+        return self.new_operation(
+            "bulkInsert",
+            self.link("regions", region, "instances"),
+            f"regions/{region}",
+            group_id,
+        )
+
+    def instances_list(
+        self, project, zone, filter=None, fields=None, maxResults=PAGE_SIZE, **kw
+    ):
+        items = [
+            inst for inst in self.instances.values() if inst["zone"].endswith(zone)
+        ]
+        return self._page(items, kw.get("pageToken"), maxResults, fields)
+
+    def instances_aggregatedList(self, project, filter=None, fields=None, **kw):
+        page = self._page(
+            list(self.instances.values()), kw.get("pageToken"), PAGE_SIZE, fields
+        )
+        return self._aggregate(page, "instances")
+
+    def _instance_op(self, op_type, zone, instance, status=None):
+        inst = self.instance(instance)
+        if status is not None:
+            inst["status"] = status
+            if status == "RUNNING":
+                inst["lastStartTimestamp"] = timestamp()
+        return self.new_operation(op_type, inst["selfLink"], f"zones/{zone}")
+
+    def instances_delete(self, project, zone, instance):
+        op = self._instance_op("delete", zone, instance)
+        with self.lock:
+            self.instances.pop(instance, None)
+        return op
+
+    def instances_start(self, project, zone, instance):
+        return self._instance_op("start", zone, instance, "RUNNING")
+
+    def instances_resume(self, project, zone, instance):
+        return self._instance_op("resume", zone, instance, "RUNNING")
+
+    def instances_stop(self, project, zone, instance):
+        return self._instance_op("stop", zone, instance, "TERMINATED")
+
+    def instances_suspend(self, project, zone, instance):
+        return self._instance_op("suspend", zone, instance, "SUSPENDED")
+
+    def instances_get(self, project, zone, instance, fields=None):
+        inst = self.instance(instance)
+        return project_fields([inst], f"({fields})")[0] if fields else inst
+
+    def instances_getGuestAttributes(self, project, zone, instance, queryPath=None):
+        self.instance(instance)
+        return {"queryPath": queryPath, "queryValue": {"items": []}}
+
+    def zoneOperations_wait(self, project, zone, operation):
+        return self.wait_operation(operation)
+
+    def zoneOperations_get(self, project, zone, operation):
+        return self.operation(operation)
+
+    def regionOperations_wait(self, project, region, operation):
+        return self.wait_operation(operation)
+
+    def regionOperations_get(self, project, region, operation):
+        return self.operation(operation)
+
+    def globalOperations_wait(self, project, operation):
+        return self.wait_operation(operation)
+
+    def globalOperations_aggregatedList(self, project, filter=None, fields=None, **kw):
+        group_ids = set(re.findall(r"operationGroupId=([\w-]+)", filter or ""))
+        types = set(re.findall(r"operationType=(\w+)", filter or ""))
+        ops = [
+            self.operation(op["name"])
+            for op in list(self.operations.values())
+            if (not group_ids or op.get("operationGroupId") in group_ids)
+            and (not types or op["operationType"] in types)
+        ]
+        page = self._page(ops, kw.get("pageToken"), PAGE_SIZE, None)
+        return self._aggregate(page, "operations")
+
+    def instanceTemplates_get(self, project, instanceTemplate, fields=None):
+        template = self.templates.get(instanceTemplate)
+        if template is None:
+            raise http_error(404, "notFound", f"template {instanceTemplate} not found")
+        return project_fields([template], f"({fields})")[0] if fields else template
+
+    def machineTypes_aggregatedList(self, project, fields=None, **kw):
+        items = {
+            f"zones/{zone}": {
+                "machineTypes": [
+                    {"name": name, "zone": zone, **info}
+                    for name, info in self.machine_types.items()
+                ]
+            }
+            for zone in self.zones
+        }
+        return {"items": items}
+
+    def machineTypes_get(self, project, zone, machineType):
+        return {"name": machineType, "zone": zone, **self.machine_types[machineType]}
+
+    def regions_get(self, project, region, fields=None):
+        return {"zones": [self.link("zones", zone) for zone in self.zones]}
+
+    def _page(self, items, token, size, fields):
+        start = int(token or 0)
+        page = {"items": project_fields(items[start : start + size], fields)}
+        if start + size < len(items):
+            page["nextPageToken"] = str(start + size)
+        return page
+
+    def _aggregate(self, page, key):
+        by_zone = {}
+        for item in page["items"]:
+            zone = item.get("zone", "").split("/")[-1] or "global"
+            by_zone.setdefault(f"zones/{zone}", {key: []})[key].append(item)
+        page["items"] = by_zone
+        return page
+
+
+class FakeRequest:
+    """an api request, executed against the fake cloud"""
+
+    def __init__(self, cloud, resource, method, kwargs):
+        self.cloud = cloud
+        self.resource = resource
+        self.method = method
+        self.kwargs = kwargs
+        self.methodId = f"compute.{resource}.{method}"
+        self.handler = getattr(cloud, f"{resource}_{method}", None)
+        if self.handler is None:
+            raise NotImplementedError(f"fake compute api has no {self.methodId}")
+
+    def execute(self, in_batch=False):
+        return self.cloud.call(self.methodId, self.handler, self.kwargs, in_batch)
+
+    def wait_remaining(self):
+        """seconds until the operation this waits on is done, 0 otherwise"""
+        if self.method != "wait":
+            return 0
+        op = self.cloud.operations.get(self.kwargs["operation"])
+        return max(op["_done_at"] - time(), 0) if op else 0
+
+    def to_json(self):
+        return json.dumps({"methodId": self.methodId, "body": None})
+
+
+class FakeBatch:
+    def __init__(self, cloud, callback):
+        self.cloud = cloud
+        self.callback = callback
+        self.requests = []
+
+    def add(self, request, request_id=None):
+        self.requests.append((request_id, request))
+
+    def execute(self):
+        for rid, resp, exc in self.cloud.execute_batch(self.requests):
+            self.callback(rid, resp, exc)
+
+
+class FakeResource:
+    def __init__(self, cloud, name):
+        self.cloud = cloud
+        self.name = name
+
+    def __getattr__(self, method):
+        if method.endswith("_next"):
+            return self._next
+        return lambda **kwargs: FakeRequest(self.cloud, self.name, method, kwargs)
+
+    def _next(self, previous, response):
+        token = response.get("nextPageToken")
+        if not token:
+            return None
+        return FakeRequest(
+            self.cloud,
+            self.name,
+            previous.method,
+            {**previous.kwargs, "pageToken": token},
+        )
+
+
+class FakeCompute:
+    """stands in for the discovery built compute client"""
+
+    def __init__(self, cloud):
+        self.cloud = cloud
+
+    def new_batch_http_request(self, callback=None):
+        return FakeBatch(self.cloud, callback)
+
+    def __getattr__(self, resource):
+        return lambda: FakeResource(self.cloud, resource)
+
+
+class FakeTpuOperation:
+    def __init__(self, cloud, result, error=None):
+        self.cloud = cloud
+        self._result = result
+        self._error = error
+        self._done_at = monotonic() + cloud.op_duration
+
+    def done(self):
+        return monotonic() >= self._done_at
+
+    def result(self):
+        while not self.done():
+            sleep(min(self._done_at - monotonic(), 1))
+        if self._error is not None:
+            raise self._error
+        return self._result
+
+
+class FakeTpuNode:
+    def __init__(self, name, state):
+        self.name = name
+        self.state = state
+        self.network_endpoints = [SimpleNamespace(ip_address="127.0.0.1")]
+
+
+class FakeTpuClient:
+    """stands in for tpu_v2.TpuClient, nodes are kept in the fake cloud"""
+
+    cloud = None
+
+    def _call(self, method, handler):
+        cloud = self.cloud
+        with cloud.lock:
+            cloud.calls[f"tpu.{method}"] += 1
+            cloud.http_calls += 1
+            quota_error = cloud.random.random() < cloud.quota_error_rate
+        if cloud.latency:
+            sleep(cloud.latency)
+        if quota_error:
+            from google.api_core.exceptions import TooManyRequests
+
+            raise TooManyRequests("Rate Limit Exceeded")
+        return handler()
+
+    def _node(self, name):
+        from google.api_core.exceptions import NotFound
+
+        node = self.cloud.tpu_nodes.get(name)
+        if node is None:
+            raise NotFound(f"node {name} not found")
+        return node
+
+    def _state(self, name):
+        from google.cloud import tpu_v2
+
+        return getattr(tpu_v2.types.cloud_tpu.Node.State, name)
+
+    def list_nodes(self, request):
+        return self._call("list_nodes", lambda: list(self.cloud.tpu_nodes.values()))
+
+    def get_node(self, request):
+        return self._call("get_node", lambda: self._node(request.name))
+
+    def get_accelerator_type(self, request):
+        from google.cloud import tpu_v2
+
+        def handler():
+            ac = tpu_v2.AcceleratorConfig()
+            ac.topology = "2x2"
+            return SimpleNamespace(accelerator_configs=[ac])
+
+        return self._call("get_accelerator_type", handler)
+
+    def create_node(self, request):
+        def handler():
+            name = f"{request.parent}/nodes/{request.node_id}"
+            node = FakeTpuNode(name, self._state("READY"))
+            self.cloud.tpu_nodes[name] = node
+            return FakeTpuOperation(self.cloud, node)
+
+        return self._call("create_node", handler)
+
+    def _set_state(self, method, request, state):
+        def handler():
+            node = self._node(request.name)
+            node.state = self._state(state)
+            return FakeTpuOperation(self.cloud, node)
+
+        return self._call(method, handler)
+
+    def start_node(self, request):
+        return self._set_state("start_node", request, "READY")
+
+    def stop_node(self, request):
+        return self._set_state("stop_node", request, "STOPPED")
+
+    def delete_node(self, request):
+        def handler():
+            node = self._node(request.name)
+            del self.cloud.tpu_nodes[request.name]
+            # the api returns the deleted node as TERMINATED
+            node.state = self._state("TERMINATED")
+            return FakeTpuOperation(self.cloud, node)
+
+        return self._call("delete_node", handler)
+
+
+def install(cloud):
+    """point the google client libraries at the fake cloud, before util is
+    imported. The TPU client is only faked if google-cloud-tpu is installed.
+    """
+    import google.auth
+    import googleapiclient.discovery
+
+    google.auth.default = lambda *args, **kwargs: (None, cloud.project)
+    googleapiclient.discovery.build = lambda *args, **kwargs: FakeCompute(cloud)
+    FakeTpuClient.cloud = cloud
+    try:
+        from google.cloud import tpu_v2
+    except ImportError:
+        return
+    tpu_v2.TpuClient = FakeTpuClient